@@ -83,9 +83,40 @@ Explanation of Pessimistic Locking
 
 #include <iostream>
 #include <string>
+#include <string_view>
 #include <vector>
 #include <unordered_map>
+#include <unordered_set>
 #include <ctime>
+#include <mutex>
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <charconv>
+#include <type_traits>
+#include <coroutine>
+#include <utility>
+#include <deque>
+#include <cstdio>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <pthread.h>
+#include <cerrno>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <chrono>
+#include <queue>
+#include <thread>
+#include <condition_variable>
+#include <atomic>
+#include <memory>
+#include <functional>
+#if defined(__SSE2__) || defined(__AVX__)
+#include <immintrin.h>
+#endif
 
 using namespace std;
 
@@ -98,54 +129,175 @@ private:
     double amount;
     string timestamp;
 
-    string getCurrentTime() {
-        time_t now = time(0);
-        char* dt = ctime(&now);
-        return string(dt);
+    // ctime_r: postings on different accounts format timestamps concurrently
+    static string formatTime(time_t when) {
+        char buf[32];
+        return ctime_r(&when, buf) ? string(buf) : string();
     }
 
 public:
     Transaction(TransactionType t, double amt) : type(t), amount(amt) {
-        timestamp = getCurrentTime();
+        timestamp = formatTime(time(0));
     }
 
-    void show() const {
+    // A transaction recorded earlier, at `when`
+    Transaction(TransactionType t, double amt, time_t when) : type(t), amount(amt) {
+        timestamp = formatTime(when);
+    }
+
+    TransactionType getType() const { return type; }
+    double getAmount() const { return amount; }
+    const string& getTimestamp() const { return timestamp; }
+
+    void show(ostream& out = cout) const {
         string tType = (type == TransactionType::DEPOSIT) ? "Deposit" : "Withdraw";
-        cout << timestamp << " | " << tType << " | Amount: $" << amount << endl;
+        out << timestamp << " | " << tType << " | Amount: $" << amount << '\n';
     }
 };
 
+// ---------------- Posting Observers ----------------
+// An applied deposit or withdrawal, reported while the account is still
+// locked, so each account's postings are observed in the order applied
+struct Posting {
+    TransactionType type;
+    string_view accountNumber;
+    double amount;
+    double balanceAfter;
+    string_view requestId; // Set when posted by an idempotent request
+};
+
+// An account about to be published, reported before any posting to it
+struct AccountOpening {
+    string_view accountNumber;
+    string_view currency;
+    double balance;
+    uint32_t ownerId;
+    string_view ownerName;
+    string_view ownerPin;
+};
+
+class IPostingObserver {
+public:
+    // Runs on the posting path; keep it short and never call back into the account
+    virtual void onPosting(const Posting& posting) = 0;
+    // An idempotent request that was refused without posting anything
+    virtual void onRejectedRequest(string_view /*requestId*/) {}
+    // Account openings and closures, reported under the bank's directory lock
+    virtual void onAccountOpened(const AccountOpening& /*opening*/) {}
+    virtual void onAccountClosed(string_view /*accountNumber*/) {}
+    virtual ~IPostingObserver() {}
+};
+
+// Tags the postings made by this thread while alive with a request id
+class PostingRequestScope {
+private:
+    static inline thread_local string_view current;
+    string_view saved;
+
+public:
+    explicit PostingRequestScope(string_view requestId) : saved(current) { current = requestId; }
+    PostingRequestScope(const PostingRequestScope&) = delete;
+    PostingRequestScope& operator=(const PostingRequestScope&) = delete;
+    ~PostingRequestScope() { current = saved; }
+
+    static string_view active() { return current; }
+};
+
 // ---------------- Account ----------------
 class Account {
 private:
     string accountNumber;
     double balance;
+    string currency; // ISO code the balance is held in
     vector<Transaction> transactions;
+    bool closed = false;
+    atomic<uint32_t> refs{1}; // The bank's reference plus one per open AccountHandle
+    atomic<IPostingObserver*> observer{nullptr};
     mutable mutex mtx; // Pessimistic lock for thread safety
 
+    // Caller holds mtx and has already applied the posting
+    void notify(TransactionType type, double amount) {
+        IPostingObserver* obs = observer.load(memory_order_acquire);
+        if (obs) obs->onPosting({type, accountNumber, amount, balance, PostingRequestScope::active()});
+    }
+
 public:
-    Account(string accNum, double bal = 0) : accountNumber(accNum), balance(bal) {}
+    Account(string accNum, double bal = 0, string cur = "USD")
+        : accountNumber(accNum), balance(bal), currency(cur) {}
+
+    // An account carried over from elsewhere with its history
+    Account(string accNum, double bal, string cur, vector<Transaction> history)
+        : accountNumber(accNum), balance(bal), currency(cur), transactions(move(history)) {}
 
     string getAccountNumber() const { return accountNumber; }
 
+    const string& getCurrency() const { return currency; }
+
+    void acquireRef() { refs.fetch_add(1, memory_order_relaxed); }
+
+    // Reports every later posting to `obs`; null stops reporting. Takes the
+    // lock, so no posting is still reporting to the old observer afterwards.
+    void setObserver(IPostingObserver* obs) {
+        lock_guard<mutex> lock(mtx);
+        observer.store(obs, memory_order_release);
+    }
+
+    // Deletes the account when the last reference goes
+    static void releaseRef(Account* acc) {
+        if (acc->refs.fetch_sub(1, memory_order_acq_rel) == 1) delete acc;
+    }
+
     // Deposit with thread safety
-    void deposit(double amount) {
+    bool deposit(double amount) {
         lock_guard<mutex> lock(mtx);  // Pessimistic lock: lock for entire operation
+        if (closed) return false;
         balance += amount;
         transactions.push_back(Transaction(TransactionType::DEPOSIT, amount));
-        cout << "Deposit successful! Balance: $" << balance << endl;
+        notify(TransactionType::DEPOSIT, amount);
+        return true;
     }
 
     // Withdraw with thread safety
     bool withdraw(double amount) {
         lock_guard<mutex> lock(mtx);  // Lock ensures no other operation can modify balance simultaneously
-        if (amount > balance) {
-            cout << "Insufficient funds!" << endl;
-            return false;
-        }
+        if (closed || amount > balance) return false; // Closed or insufficient funds
         balance -= amount;
         transactions.push_back(Transaction(TransactionType::WITHDRAW, amount));
-        cout << "Withdrawal successful! Balance: $" << balance << endl;
+        notify(TransactionType::WITHDRAW, amount);
+        return true;
+    }
+
+    // Batched withdrawals: one lock acquisition for the whole batch
+    void withdrawBatch(const vector<double>& amounts, vector<char>& results) {
+        lock_guard<mutex> lock(mtx);
+        results.assign(amounts.size(), 0);
+        for (size_t i = 0; i < amounts.size() && !closed; i++) {
+            if (amounts[i] > balance) continue;
+            balance -= amounts[i];
+            transactions.push_back(Transaction(TransactionType::WITHDRAW, amounts[i]));
+            notify(TransactionType::WITHDRAW, amounts[i]);
+            results[i] = 1;
+        }
+    }
+
+    // Batched deposits: one lock acquisition for the whole batch
+    bool depositBatch(const vector<double>& amounts) {
+        lock_guard<mutex> lock(mtx);
+        if (closed) return false;
+        for (double amount : amounts) {
+            balance += amount;
+            transactions.push_back(Transaction(TransactionType::DEPOSIT, amount));
+            notify(TransactionType::DEPOSIT, amount);
+        }
+        return true;
+    }
+
+    // Only an empty account can be closed unless `requireEmpty` is false;
+    // later operations on it fail
+    bool close(bool requireEmpty = true) {
+        lock_guard<mutex> lock(mtx);
+        if (closed || (requireEmpty && balance != 0)) return false;
+        closed = true;
         return true;
     }
 
@@ -154,199 +306,6318 @@ public:
         return balance;
     }
 
-    void showTransactions() const {
+    vector<Transaction> getTransactions() const {
+        lock_guard<mutex> lock(mtx); // Lock ensures consistent transaction history
+        return transactions;
+    }
+
+    // Calls fn(balance, transactions) with the account locked, so the two
+    // agree and no posting lands in between
+    template <typename Fn>
+    void inspect(Fn fn) const {
+        lock_guard<mutex> lock(mtx);
+        fn(balance, transactions);
+    }
+
+    void showTransactions(ostream& out = cout) const {
         lock_guard<mutex> lock(mtx); // Lock ensures consistent transaction history
         if (transactions.empty()) {
-            cout << "No transactions yet." << endl;
+            out << "No transactions yet.\n";
             return;
         }
-        cout << "Transaction history for account " << accountNumber << ":\n";
+        out << "Transaction history for account " << accountNumber << ":\n";
         for (const auto& t : transactions) {
-            t.show();
+            t.show(out);
+        }
+    }
+};
+
+// ---------------- Account Handles ----------------
+/*
+A session-scoped reference to a resolved Account.
+- Opening a handle takes one atomic reference on the Account (under the
+  bank's epoch pin), so the Account outlives the session even if it is
+  closed and unlinked meanwhile; operations on it then simply fail.
+- Copies share one heap block with a plain (non-atomic) count, so passing
+  handles around inside a session costs no atomics. A handle and its
+  copies must therefore stay on one thread at a time.
+- A handle always carries the account number, so services that cannot
+  resolve accounts locally fall back to lookups by number.
+*/
+class AccountHandle {
+private:
+    struct Block {
+        Account* account;     // Null when unresolved
+        string accountNumber;
+        uint32_t localRefs;
+    };
+    Block* block = nullptr;
+
+    void release() {
+        if (block && --block->localRefs == 0) {
+            if (block->account) Account::releaseRef(block->account);
+            delete block;
         }
+        block = nullptr;
+    }
+
+public:
+    AccountHandle() = default;
+
+    // Takes over a reference the caller already acquired on `acc`
+    static AccountHandle adopt(Account* acc) {
+        AccountHandle h;
+        h.block = new Block{acc, acc->getAccountNumber(), 1};
+        return h;
+    }
+
+    static AccountHandle unresolved(const string& accNum) {
+        AccountHandle h;
+        h.block = new Block{nullptr, accNum, 1};
+        return h;
+    }
+
+    AccountHandle(const AccountHandle& other) : block(other.block) {
+        if (block) block->localRefs++;
+    }
+    AccountHandle(AccountHandle&& other) noexcept : block(other.block) { other.block = nullptr; }
+    AccountHandle& operator=(AccountHandle other) {
+        swap(block, other.block);
+        return *this;
+    }
+    ~AccountHandle() { release(); }
+
+    bool isResolved() const { return block && block->account; }
+    bool empty() const { return !block; }
+    Account* get() const { return block ? block->account : nullptr; }
+    Account* operator->() const { return get(); }
+    const string& accountNumber() const {
+        static const string none;
+        return block ? block->accountNumber : none;
     }
 };
 
 // ---------------- User ----------------
 class User {
+public:
+    static const uint32_t NO_ID = UINT32_MAX;
+
 private:
     string name;
     string pin;
+    uint32_t id = NO_ID; // Assigned by the BankService the user is added to
     vector<Account*> accounts;
+    vector<string> accountNumbers; // Parallel to `accounts`; safe to use after an account is freed
+    mutable mutex accountsMtx;     // BankService unlinks closed accounts while sessions read the list
 
 public:
     User(string n, string p) : name(n), pin(p) {}
 
+    uint32_t getId() const { return id; }
+    void setId(uint32_t userId) { id = userId; }
+
     bool authenticate(string inputPin) const { return pin == inputPin; }
 
-    void addAccount(Account* account) { accounts.push_back(account); }
+    // For replicating the user to another bank; sessions use authenticate
+    const string& getName() const { return name; }
+    const string& getPin() const { return pin; }
+
+    void addAccount(Account* account) {
+        lock_guard<mutex> lock(accountsMtx);
+        accounts.push_back(account);
+        accountNumbers.push_back(account->getAccountNumber());
+    }
+
+    void removeAccount(Account* account) {
+        lock_guard<mutex> lock(accountsMtx);
+        for (size_t i = 0; i < accounts.size();) {
+            if (accounts[i] == account) {
+                accounts.erase(accounts.begin() + i);
+                accountNumbers.erase(accountNumbers.begin() + i);
+            } else {
+                i++;
+            }
+        }
+    }
+
+    // A copy: the list may change once the user is published. Only the
+    // BankService that owns the accounts may dereference them.
+    vector<Account*> getAccounts() const {
+        lock_guard<mutex> lock(accountsMtx);
+        return accounts;
+    }
+
+    vector<string> getAccountNumbers() const {
+        lock_guard<mutex> lock(accountsMtx);
+        return accountNumbers;
+    }
 
-    vector<Account*>& getAccounts() { return accounts; }
+    // Same name and PIN, no accounts and no id yet
+    User* copyWithoutAccounts() const { return new User(name, pin); }
 };
 
 // ---------------- Bank Service Interface ----------------
+// Outcome of an idempotent request, as remembered by the bank
+enum class RequestStatus { UNKNOWN, IN_FLIGHT, APPLIED, REJECTED };
+
 class IBankService {
 public:
     virtual bool deposit(const string& accNum, double amount) = 0;
     virtual bool withdraw(const string& accNum, double amount) = 0;
+    // Withdraw an amount given in `currency`, converted at posting time
+    virtual bool withdrawInCurrency(const string& accNum, double amount, const string& currency) = 0;
     virtual double getBalance(const string& accNum) = 0;
     virtual void showTransactions(const string& accNum) = 0;
+    virtual vector<Transaction> getTransactions(const string& accNum) = 0;
     virtual User* getUserByAccount(const string& accNum) = 0;
+    // Implementations may reclaim closed accounts; see BankService::pinAccounts
     virtual Account* getAccount(const string& accNum) = 0;
+
+    // Checks the PIN of the account's owner. Services whose users live
+    // elsewhere check it there rather than hand out the PIN.
+    virtual bool authenticate(const string& accNum, const string& pin) {
+        User* user = getUserByAccount(accNum);
+        return user && user->authenticate(pin);
+    }
+
+    // Handle-based variants let a session skip the lookup by account number.
+    // The defaults fall back to it for services that do not resolve handles.
+    virtual AccountHandle openAccountHandle(const string& accNum) {
+        return AccountHandle::unresolved(accNum);
+    }
+    virtual bool deposit(const AccountHandle& h, double amount) {
+        return deposit(h.accountNumber(), amount);
+    }
+    virtual bool withdraw(const AccountHandle& h, double amount) {
+        return withdraw(h.accountNumber(), amount);
+    }
+    virtual bool withdrawInCurrency(const AccountHandle& h, double amount, const string& currency) {
+        return withdrawInCurrency(h.accountNumber(), amount, currency);
+    }
+    virtual double getBalance(const AccountHandle& h) {
+        return getBalance(h.accountNumber());
+    }
+    virtual void showTransactions(const AccountHandle& h) {
+        showTransactions(h.accountNumber());
+    }
+    virtual vector<Transaction> getTransactions(const AccountHandle& h) {
+        return getTransactions(h.accountNumber());
+    }
+
+    // Idempotent postings: a request id is applied at most once and its
+    // outcome can be queried later, e.g. by a front end after a restart.
+    // An empty currency means the account's own. The defaults just post,
+    // and services without a request log report UNKNOWN.
+    virtual bool depositIdempotent(const string& /*requestId*/, const AccountHandle& h, double amount) {
+        return deposit(h, amount);
+    }
+    virtual bool withdrawIdempotent(const string& /*requestId*/, const AccountHandle& h, double amount,
+                                    const string& currency) {
+        return currency.empty() ? withdraw(h, amount) : withdrawInCurrency(h, amount, currency);
+    }
+    virtual RequestStatus getRequestStatus(const string& /*requestId*/) { return RequestStatus::UNKNOWN; }
+    // ISO code of the account's currency; empty if unknown
+    virtual string getCurrency(const string& accNum) {
+        Account* acc = getAccount(accNum);
+        return acc ? acc->getCurrency() : "";
+    }
+    // Whether UNKNOWN means "never received" rather than "no log to ask"
+    virtual bool keepsRequestLog() { return false; }
+
+    // Handles for every account of an authenticated user, in opening order
+    virtual vector<AccountHandle> openUserAccounts(User* user) {
+        vector<AccountHandle> handles;
+        for (const string& accNum : user->getAccountNumbers()) handles.push_back(openAccountHandle(accNum));
+        return handles;
+    }
     virtual ~IBankService() {}
 };
 
-// ---------------- Concrete BankService ----------------
-class BankService : public IBankService {
+// ---------------- Epoch-Based Reclamation ----------------
+/*
+Lets BankService free closed accounts, and FxRateTable replaced rate
+tables, while lookups stay lock-free.
+- A reader pins the current global epoch in one of a fixed set of slots
+  (EpochGuard) for as long as it uses pointers it looked up, then unpins.
+- A writer first unlinks an object, then retires it tagged with the
+  current epoch and advances the global epoch.
+- A retired object is freed once every pinned slot shows a later epoch:
+  only readers pinned at or before its tag could still be holding it.
+*/
+class EpochManager {
+public:
+    static const int MAX_PINS = 256;
+
 private:
-    unordered_map<string, User*> users;
-    unordered_map<string, Account*> accounts;
+    struct alignas(64) PinSlot {
+        atomic<uint64_t> epoch{0}; // 0 = slot free
+    };
+    struct Retired {
+        uint64_t epoch;
+        function<void()> reclaim;
+    };
+
+    atomic<uint64_t> globalEpoch{1};
+    atomic<size_t> nextSlot{0}; // Spreads readers over the slots
+    PinSlot slots[MAX_PINS];
+    mutex retireMtx;
+    vector<Retired> retired;
 
 public:
-    void addUser(User* user) {
-        for (auto acc : user->getAccounts()) {
-            users[acc->getAccountNumber()] = user;
-            accounts[acc->getAccountNumber()] = acc;
+    ~EpochManager() {
+        for (auto& r : retired) r.reclaim();
+    }
+
+    int pin() {
+        size_t start = nextSlot.fetch_add(1, memory_order_relaxed);
+        for (;;) {
+            for (int n = 0; n < MAX_PINS; n++) {
+                int i = (int)((start + n) % MAX_PINS);
+                uint64_t expected = 0;
+                if (slots[i].epoch.compare_exchange_strong(expected, globalEpoch.load())) return i;
+            }
+            this_thread::yield(); // Every slot pinned: wait for a reader to finish
         }
     }
 
-    bool deposit(const string& accNum, double amount) override {
-        Account* acc = getAccount(accNum);
-        if (!acc) return false;
-        acc->deposit(amount);
-        return true;
+    void unpin(int slot) { slots[slot].epoch.store(0, memory_order_release); }
+
+    // `reclaim` runs once no reader can still reach the unlinked object
+    void retire(function<void()> reclaim) {
+        lock_guard<mutex> lock(retireMtx);
+        retired.push_back({globalEpoch.fetch_add(1), move(reclaim)});
     }
 
-    bool withdraw(const string& accNum, double amount) override {
-        Account* acc = getAccount(accNum);
-        if (!acc) return false;
-        return acc->withdraw(amount);
+    size_t tryReclaim() {
+        // Only entries retired before the scan started are candidates
+        uint64_t safe = globalEpoch.load();
+        for (auto& s : slots) {
+            uint64_t e = s.epoch.load();
+            if (e != 0 && e < safe) safe = e;
+        }
+        vector<function<void()>> ready;
+        {
+            lock_guard<mutex> lock(retireMtx);
+            auto keep = partition(retired.begin(), retired.end(),
+                                  [&](const Retired& r) { return r.epoch >= safe; });
+            for (auto it = keep; it != retired.end(); ++it) ready.push_back(move(it->reclaim));
+            retired.erase(keep, retired.end());
+        }
+        for (auto& reclaim : ready) reclaim();
+        return ready.size();
     }
 
-    double getBalance(const string& accNum) override {
-        Account* acc = getAccount(accNum);
-        if (!acc) return -1;
-        return acc->getBalance();
+    size_t pendingReclaims() {
+        lock_guard<mutex> lock(retireMtx);
+        return retired.size();
     }
 
-    void showTransactions(const string& accNum) override {
-        Account* acc = getAccount(accNum);
-        if (acc) acc->showTransactions();
+    // Waits until every reader pinned before the call has unpinned
+    void synchronize() {
+        uint64_t target = globalEpoch.fetch_add(1) + 1;
+        for (auto& s : slots) {
+            for (;;) {
+                uint64_t e = s.epoch.load();
+                if (e == 0 || e >= target) break;
+                this_thread::yield();
+            }
+        }
     }
+};
 
-    User* getUserByAccount(const string& accNum) override {
-        if (users.find(accNum) != users.end())
-            return users[accNum];
-        return nullptr;
+// RAII pin: pointers looked up while it is alive stay valid
+class EpochGuard {
+private:
+    EpochManager* manager;
+    int slot;
+
+public:
+    explicit EpochGuard(EpochManager& m) : manager(&m), slot(m.pin()) {}
+    EpochGuard(EpochGuard&& other) noexcept : manager(other.manager), slot(other.slot) {
+        other.manager = nullptr;
     }
+    EpochGuard(const EpochGuard&) = delete;
+    EpochGuard& operator=(const EpochGuard&) = delete;
+    ~EpochGuard() {
+        if (manager) manager->unpin(slot);
+    }
+};
 
-    Account* getAccount(const string& accNum) override {
-        if (accounts.find(accNum) != accounts.end())
-            return accounts[accNum];
-        return nullptr;
+// ---------------- Foreign Exchange ----------------
+/*
+FxRateTable holds the rates as an immutable snapshot behind an atomic
+pointer.
+- Readers (every cross-currency posting and the bulk report) do a single
+  atomic load; they never take a lock or see a half-updated table.
+- Writers build a fresh snapshot and swap it in. The replaced one is
+  retired through the table's EpochManager and freed once no reader that
+  might have loaded it is still pinned.
+- Rates are quoted against the base currency: toBase["EUR"] = 1.08 means
+  1 EUR = 1.08 base units.
+*/
+struct FxSnapshot {
+    string base;
+    unordered_map<string, int> index;   // Currency code -> slot in toBase
+    vector<double> toBase;
+
+    int find(const string& currency) const {
+        auto it = index.find(currency);
+        return it == index.end() ? -1 : it->second;
     }
 };
 
-// ---------------- ATM (Interface Layer) ----------------
-class ATM {
+class FxRateTable {
 private:
-    IBankService* bankService;
-    User* currentUser = nullptr;
-    Account* currentAccount = nullptr;
+    mutable EpochManager epochs; // Readers pin it while they use a snapshot
+    atomic<const FxSnapshot*> current;
+    mutex writeMtx;
 
 public:
-    ATM(IBankService* service) : bankService(service) {}
+    FxRateTable(const string& base = "USD") {
+        FxSnapshot* snap = new FxSnapshot();
+        snap->base = base;
+        snap->index[base] = 0;
+        snap->toBase.push_back(1.0);
+        current.store(snap);
+    }
 
-    bool login(const string& accNum, const string& pin) {
-        User* user = bankService->getUserByAccount(accNum);
-        if (user && user->authenticate(pin)) {
-            currentUser = user;
-            currentAccount = bankService->getAccount(accNum);
-            cout << "Login successful!\n";
-            return true;
+    FxRateTable(const FxRateTable&) = delete;
+    FxRateTable& operator=(const FxRateTable&) = delete;
+
+    ~FxRateTable() { delete current.load(memory_order_relaxed); }
+
+    // Keeps pointers returned by snapshot() valid while the guard lives
+    EpochGuard pin() const { return EpochGuard(epochs); }
+
+    // Only valid while pinned
+    const FxSnapshot* snapshot() const { return current.load(memory_order_acquire); }
+
+    // Publishes a new table; the base currency always has rate 1
+    void setRates(const unordered_map<string, double>& ratesToBase) {
+        lock_guard<mutex> lock(writeMtx);
+        FxSnapshot* snap = new FxSnapshot();
+        snap->base = snapshot()->base;
+        snap->index[snap->base] = 0;
+        snap->toBase.push_back(1.0);
+        for (const auto& [currency, rate] : ratesToBase) {
+            if (currency == snap->base || rate <= 0) continue;
+            snap->index[currency] = (int)snap->toBase.size();
+            snap->toBase.push_back(rate);
         }
-        cout << "Invalid account number or PIN.\n";
-        return false;
+        const FxSnapshot* old = current.exchange(snap, memory_order_acq_rel);
+        epochs.retire([old] { delete old; });
+        epochs.tryReclaim();
     }
 
-    void logout() {
-        currentUser = nullptr;
-        currentAccount = nullptr;
-        cout << "Logged out successfully.\n";
+    // Returns false when either currency has no rate
+    bool convert(double amount, const string& from, const string& to, double& out) const {
+        EpochGuard guard(epochs);
+        const FxSnapshot* snap = snapshot();
+        int f = snap->find(from), t = snap->find(to);
+        if (f < 0 || t < 0) return false;
+        out = amount * snap->toBase[f] / snap->toBase[t];
+        return true;
     }
+};
 
-    void showMenu() {
-        if (!currentUser) {
-            cout << "Please login first.\n";
-            return;
+// Multiplies n balances by one rate and returns their sum.
+// Balances are grouped per currency by the caller, so the rate is a scalar
+// broadcast and the loop runs 4 (AVX) or 2 (SSE2) lanes at a time.
+inline double scaleAndSum(const double* in, double rate, double* out, size_t n) {
+    size_t i = 0;
+    double sum = 0;
+#if defined(__AVX__)
+    __m256d r = _mm256_set1_pd(rate), acc = _mm256_setzero_pd();
+    for (; i + 4 <= n; i += 4) {
+        __m256d v = _mm256_mul_pd(_mm256_loadu_pd(in + i), r);
+        _mm256_storeu_pd(out + i, v);
+        acc = _mm256_add_pd(acc, v);
+    }
+    double lanes[4];
+    _mm256_storeu_pd(lanes, acc);
+    sum = lanes[0] + lanes[1] + lanes[2] + lanes[3];
+#elif defined(__SSE2__)
+    __m128d r = _mm_set1_pd(rate), acc = _mm_setzero_pd();
+    for (; i + 2 <= n; i += 2) {
+        __m128d v = _mm_mul_pd(_mm_loadu_pd(in + i), r);
+        _mm_storeu_pd(out + i, v);
+        acc = _mm_add_pd(acc, v);
+    }
+    double lanes[2];
+    _mm_storeu_pd(lanes, acc);
+    sum = lanes[0] + lanes[1];
+#endif
+    for (; i < n; i++) {
+        out[i] = in[i] * rate;
+        sum += out[i];
+    }
+    return sum;
+}
+
+struct BaseCurrencyReport {
+    string base;
+    vector<string> accountNumbers;
+    vector<double> converted;       // Balance of accountNumbers[i] in the base currency
+    vector<string> unconverted;     // Accounts whose currency has no rate
+    double total = 0;
+};
+
+// ---------------- Standing Orders ----------------
+/*
+Recurring transfers (toAccount set) and payments (toAccount empty) that
+BankService executes on a schedule.
+- StandingOrderBook keeps the orders in a vector indexed by id and a
+  min-heap of (due time, id), so the next due order is always at the top
+  and millions of orders cost one small heap entry each.
+- Cancelled orders are dropped lazily when their heap entry surfaces.
+- Recurring orders are pushed back with their next due time when popped.
+*/
+struct StandingOrder {
+    uint64_t id = 0;
+    string fromAccount;
+    string toAccount;               // Empty for a payment leaving the bank
+    double amount = 0;
+    chrono::system_clock::time_point nextDue;
+    chrono::seconds interval{0};    // Zero for a one-off order
+    bool active = true;
+};
+
+struct StandingOrderStats {
+    uint64_t executed = 0;
+    uint64_t failed = 0;
+    double totalLagMs = 0;          // Sum of (execution time - due time)
+    double maxLagMs = 0;
+
+    double averageLagMs() const {
+        uint64_t n = executed + failed;
+        return n ? totalLagMs / n : 0;
+    }
+};
+
+class StandingOrderBook {
+private:
+    struct DueEntry {
+        chrono::system_clock::time_point due;
+        uint64_t id;
+        bool operator>(const DueEntry& other) const { return due > other.due; }
+    };
+
+    vector<StandingOrder> orders;
+    priority_queue<DueEntry, vector<DueEntry>, greater<DueEntry>> dueQueue;
+
+public:
+    uint64_t add(const string& from, const string& to, double amount,
+                 chrono::system_clock::time_point firstDue, chrono::seconds interval) {
+        StandingOrder order;
+        order.id = orders.size();
+        order.fromAccount = from;
+        order.toAccount = to;
+        order.amount = amount;
+        order.nextDue = firstDue;
+        order.interval = interval;
+        orders.push_back(order);
+        dueQueue.push({firstDue, order.id});
+        return order.id;
+    }
+
+    bool cancel(uint64_t id) {
+        if (id >= orders.size() || !orders[id].active) return false;
+        orders[id].active = false;
+        return true;
+    }
+
+    bool empty() const { return dueQueue.empty(); }
+
+    chrono::system_clock::time_point nextDue() const { return dueQueue.top().due; }
+
+    // Pops every order due at `now`; each copy carries the due time it fired for
+    void popDue(chrono::system_clock::time_point now, vector<StandingOrder>& out) {
+        while (!dueQueue.empty() && dueQueue.top().due <= now) {
+            DueEntry entry = dueQueue.top();
+            dueQueue.pop();
+            StandingOrder& order = orders[entry.id];
+            if (!order.active) continue;
+            out.push_back(order);
+            if (order.interval.count() > 0) {
+                order.nextDue += order.interval;
+                dueQueue.push({order.nextDue, order.id});
+            } else {
+                order.active = false;
+            }
         }
+    }
+};
 
-        int choice;
-        double amount;
-        do {
-            cout << "\n--- ATM Menu ---\n";
-            cout << "1. Check Balance\n";
-            cout << "2. Deposit\n";
-            cout << "3. Withdraw\n";
-            cout << "4. Show Transactions\n";
-            cout << "5. Logout\n";
-            cout << "Enter choice: ";
-            cin >> choice;
+// ---------------- Concrete BankService ----------------
+/*
+Account lookups go through an immutable AccountDirectory snapshot.
+- Readers pin an epoch, load the directory pointer and look up; no locks.
+- The directory is a two-level radix of small immutable shards. addUsers
+  and closeAccount copy only the path to each shard they touch, publish
+  the new top level and retire the replaced parts (and any closed
+  Account) via EpochManager, so one insert costs the same however many
+  accounts there are.
+- BankService owns accounts once added: closing drops its reference, and
+  the Account is deleted when the last AccountHandle is released too.
+*/
+struct DirectoryShard {
+    unordered_map<string, User*> users;       // By account number
+    unordered_map<string, Account*> accounts; // By account number
+    vector<vector<Account*>> userAccounts;    // Indexed by User id / SHARDS
+};
 
-            switch (choice) {
-                case 1:
-                    cout << "Balance: $" << bankService->getBalance(currentAccount->getAccountNumber()) << endl;
-                    break;
-                case 2:
-                    cout << "Enter amount to deposit: ";
-                    cin >> amount;
-                    bankService->deposit(currentAccount->getAccountNumber(), amount);
-                    break;
-                case 3:
-                    cout << "Enter amount to withdraw: ";
-                    cin >> amount;
-                    bankService->withdraw(currentAccount->getAccountNumber(), amount);
-                    break;
-                case 4:
-                    bankService->showTransactions(currentAccount->getAccountNumber());
-                    break;
-                case 5:
-                    logout();
-                    break;
-                default:
-                    cout << "Invalid choice.\n";
+struct DirectoryNode {
+    DirectoryShard* shards[256] = {}; // Null: empty
+};
+
+// Two-level radix of shards; null nodes and shards are empty
+struct AccountDirectory {
+    static const size_t FANOUT = 256;
+    static const size_t SHARDS = FANOUT * FANOUT;
+
+    DirectoryNode* nodes[FANOUT] = {}; // Never modified once published
+    uint32_t userCount = 0;
+
+    static size_t shardOf(const string& accNum) { return hash<string>()(accNum) % SHARDS; }
+
+    // Null if the shard is empty
+    const DirectoryShard* shard(size_t i) const {
+        const DirectoryNode* node = nodes[i / FANOUT];
+        return node ? node->shards[i % FANOUT] : nullptr;
+    }
+
+    template <typename Map>
+    static typename Map::mapped_type find(const Map& map, const string& accNum) {
+        auto it = map.find(accNum);
+        return it == map.end() ? nullptr : it->second;
+    }
+
+    Account* findAccount(const string& accNum) const {
+        const DirectoryShard* s = shard(shardOf(accNum));
+        return s ? find(s->accounts, accNum) : nullptr;
+    }
+
+    User* findUser(const string& accNum) const {
+        const DirectoryShard* s = shard(shardOf(accNum));
+        return s ? find(s->users, accNum) : nullptr;
+    }
+
+    // Null for an unknown user id
+    const vector<Account*>* userAccounts(uint32_t id) const {
+        const DirectoryShard* s = shard(id % SHARDS);
+        return s && id / SHARDS < s->userAccounts.size() ? &s->userAccounts[id / SHARDS] : nullptr;
+    }
+
+    // Calls fn(accNum, account, owner) for every account
+    template <typename Fn>
+    void forEachAccount(Fn fn) const {
+        for (const DirectoryNode* node : nodes) {
+            for (size_t i = 0; node && i < FANOUT; i++) {
+                const DirectoryShard* s = node->shards[i];
+                if (!s) continue;
+                for (const auto& [accNum, acc] : s->accounts) fn(accNum, acc, find(s->users, accNum));
             }
-        } while (choice != 5 && currentUser);
+        }
+    }
+
+    // Frees the directory with every node and shard in it
+    static void destroy(const AccountDirectory* dir) {
+        for (const DirectoryNode* node : dir->nodes) {
+            if (!node) continue;
+            for (DirectoryShard* s : node->shards) delete s;
+            delete node;
+        }
+        delete dir;
     }
 };
 
-// ---------------- Main ----------------
-int main() {
-    BankService bank;
+// Copy-on-write access for one directory update: the path to each shard
+// it modifies is copied once, and what it replaced is remembered
+class DirectoryWriter {
+private:
+    AccountDirectory& next;
+    bool copiedNode[AccountDirectory::FANOUT] = {};
+    vector<size_t> copiedShards;
 
-    // Create users and accounts
-    User* user1 = new User("Alice", "1234");
-    Account* acc1 = new Account("ACC1001", 1000);
-    user1->addAccount(acc1);
+public:
+    vector<const DirectoryNode*> replacedNodes;
+    vector<const DirectoryShard*> replacedShards;
 
-    User* user2 = new User("Bob", "4321");
-    Account* acc2 = new Account("ACC2001", 500);
-    user2->addAccount(acc2);
+    explicit DirectoryWriter(AccountDirectory& dir) : next(dir) {}
 
-    bank.addUser(user1);
-    bank.addUser(user2);
+    DirectoryShard& shard(size_t i) {
+        size_t n = i / AccountDirectory::FANOUT;
+        if (!copiedNode[n]) {
+            replacedNodes.push_back(next.nodes[n]);
+            next.nodes[n] = next.nodes[n] ? new DirectoryNode(*next.nodes[n]) : new DirectoryNode();
+            copiedNode[n] = true;
+        }
+        DirectoryShard*& slot = next.nodes[n]->shards[i % AccountDirectory::FANOUT];
+        if (find(copiedShards.begin(), copiedShards.end(), i) == copiedShards.end()) {
+            replacedShards.push_back(slot);
+            slot = slot ? new DirectoryShard(*slot) : new DirectoryShard();
+            copiedShards.push_back(i);
+        }
+        return *slot;
+    }
+
+    DirectoryShard& accountShard(const string& accNum) { return shard(AccountDirectory::shardOf(accNum)); }
 
-    ATM atm(&bank);
+    vector<Account*>& userAccounts(uint32_t id) {
+        auto& lists = shard(id % AccountDirectory::SHARDS).userAccounts;
+        if (lists.size() <= id / AccountDirectory::SHARDS) lists.resize(id / AccountDirectory::SHARDS + 1);
+        return lists[id / AccountDirectory::SHARDS];
+    }
+
+    uint32_t newUserId() { return next.userCount++; }
+
+    // Keeps newUserId from handing out `id`, which was assigned elsewhere
+    void reserveUserId(uint32_t id) { next.userCount = max(next.userCount, id + 1); }
+};
+
+class BankService : public IBankService {
+private:
+    EpochManager epochs;
+    atomic<const AccountDirectory*> directory{new AccountDirectory()};
+    mutex directoryWriteMtx; // Serializes directory writers only
+    vector<unique_ptr<User>> adoptedUsers; // Created by openReplicatedAccount (guarded by directoryWriteMtx)
+    FxRateTable fx;
+    atomic<IPostingObserver*> postingObserver{nullptr};
+
+    // Outcomes of idempotent requests; the oldest are forgotten first
+    static const size_t MAX_REMEMBERED_REQUESTS = 1 << 20;
+    unordered_map<string, RequestStatus> requestOutcomes;
+    deque<string> requestOrder;
+    mutex requestMtx;
 
-    string accNum, pin;
-    cout << "Enter account number: ";
-    cin >> accNum;
-    cout << "Enter PIN: ";
-    cin >> pin;
+    // Runs `apply` at most once per request id; repeats get the recorded outcome
+    template <typename Fn>
+    bool runOnce(const string& requestId, Fn apply) {
+        {
+            lock_guard<mutex> lock(requestMtx);
+            auto [it, inserted] = requestOutcomes.try_emplace(requestId, RequestStatus::IN_FLIGHT);
+            if (!inserted) return it->second == RequestStatus::APPLIED;
+            requestOrder.push_back(requestId);
+            if (requestOrder.size() > MAX_REMEMBERED_REQUESTS) {
+                requestOutcomes.erase(requestOrder.front());
+                requestOrder.pop_front();
+            }
+        }
+        bool ok;
+        {
+            PostingRequestScope scope(requestId);
+            ok = apply();
+        }
+        if (!ok) {
+            EpochGuard guard(epochs); // See setPostingObserver
+            IPostingObserver* obs = postingObserver.load(memory_order_acquire);
+            if (obs) obs->onRejectedRequest(requestId);
+        }
+        lock_guard<mutex> lock(requestMtx);
+        auto it = requestOutcomes.find(requestId);
+        if (it != requestOutcomes.end()) it->second = ok ? RequestStatus::APPLIED : RequestStatus::REJECTED;
+        return ok;
+    }
+
+    // Standing order scheduler state (guarded by orderMtx)
+    StandingOrderBook orderBook;
+    StandingOrderStats orderStats;
+    mutex orderMtx;
+    condition_variable orderCv;
+    thread schedulerThread;
+    bool stopping = false;
 
-    if (atm.login(accNum, pin)) {
-        atm.showMenu();
+    // Sleeps until the earliest order is due (or an earlier one is added)
+    void schedulerLoop() {
+        unique_lock<mutex> lock(orderMtx);
+        while (!stopping) {
+            if (orderBook.empty()) {
+                orderCv.wait(lock);
+                continue;
+            }
+            auto due = orderBook.nextDue();
+            if (orderCv.wait_until(lock, due) == cv_status::no_timeout) continue;
+            lock.unlock();
+            runDueOrders(chrono::system_clock::now());
+            lock.lock();
+        }
     }
 
+    // Groups orders by key account and runs `apply` once per group
+    template <typename KeyFn, typename ApplyFn>
+    static void forEachAccountGroup(vector<StandingOrder>& due, KeyFn key, ApplyFn apply) {
+        sort(due.begin(), due.end(), [&](const StandingOrder& a, const StandingOrder& b) {
+            return key(a) < key(b);
+        });
+        for (size_t i = 0; i < due.size();) {
+            size_t j = i;
+            while (j < due.size() && key(due[j]) == key(due[i])) j++;
+            apply(i, j);
+            i = j;
+        }
+    }
+
+    // Caller must hold an EpochGuard for as long as it uses the result
+    Account* lookupAccount(const string& accNum) const {
+        return directory.load(memory_order_acquire)->findAccount(accNum);
+    }
+
+    // Converts `amount` from `currency` into the account's currency at posting time
+    bool withdrawFrom(Account* acc, double amount, const string& currency) {
+        double posted = amount;
+        if (!currency.empty() && currency != acc->getCurrency() &&
+            !fx.convert(amount, currency, acc->getCurrency(), posted))
+            return false; // No exchange rate
+        return acc->withdraw(posted);
+    }
+
+    // Copy-on-write update of the directory; `mutate` gets a DirectoryWriter
+    template <typename Fn>
+    void updateDirectory(Fn mutate) {
+        lock_guard<mutex> lock(directoryWriteMtx);
+        const AccountDirectory* old = directory.load(memory_order_relaxed);
+        AccountDirectory* next = new AccountDirectory(*old);
+        DirectoryWriter writer(*next);
+        mutate(writer);
+        directory.store(next, memory_order_release);
+        epochs.retire([old, nodes = move(writer.replacedNodes), shards = move(writer.replacedShards)] {
+            for (const DirectoryNode* node : nodes) delete node;
+            for (const DirectoryShard* shard : shards) delete shard;
+            delete old;
+        });
+        epochs.tryReclaim();
+    }
+
+    // Closes and unlinks the accounts with one directory copy; returns how many
+    size_t retireAccounts(const vector<string>& accNums, bool requireEmpty) {
+        vector<pair<string, Account*>> closed;
+        {
+            EpochGuard guard(epochs);
+            for (const string& accNum : accNums) {
+                Account* acc = lookupAccount(accNum);
+                if (acc && acc->close(requireEmpty)) closed.push_back({accNum, acc});
+            }
+        }
+        if (closed.empty()) return 0;
+        updateDirectory([&](DirectoryWriter& dir) {
+            IPostingObserver* obs = postingObserver.load(memory_order_relaxed);
+            for (const auto& [accNum, acc] : closed) {
+                if (obs) obs->onAccountClosed(accNum);
+                DirectoryShard& shard = dir.accountShard(accNum);
+                User* owner = shard.users[accNum];
+                shard.users.erase(accNum);
+                shard.accounts.erase(accNum);
+                if (owner) {
+                    auto& list = dir.userAccounts(owner->getId());
+                    list.erase(remove(list.begin(), list.end(), acc), list.end());
+                    owner->removeAccount(acc); // Still under directoryWriteMtx, like addUsers' reads
+                }
+            }
+        });
+        for (const auto& [accNum, acc] : closed) epochs.retire([acc = acc] { Account::releaseRef(acc); });
+        epochs.tryReclaim();
+        return closed.size();
+    }
+
+public:
+    ~BankService() {
+        stopScheduler();
+        AccountDirectory::destroy(directory.load());
+    }
+
+    void addUser(User* user) { addUsers({user}); }
+
+    // Publishes several users with a single directory update
+    void addUsers(const vector<User*>& newUsers) {
+        updateDirectory([&](DirectoryWriter& dir) {
+            IPostingObserver* obs = postingObserver.load(memory_order_relaxed);
+            for (User* user : newUsers) {
+                if (user->getId() == User::NO_ID) user->setId(dir.newUserId());
+                vector<Account*> accounts = user->getAccounts();
+                dir.userAccounts(user->getId()) = accounts;
+                for (auto acc : accounts) {
+                    acc->setObserver(obs);
+                    DirectoryShard& shard = dir.accountShard(acc->getAccountNumber());
+                    if (obs && !shard.accounts.count(acc->getAccountNumber()))
+                        obs->onAccountOpened({acc->getAccountNumber(), acc->getCurrency(), acc->getBalance(),
+                                              user->getId(), user->getName(), user->getPin()});
+                    shard.users[acc->getAccountNumber()] = user;
+                    shard.accounts[acc->getAccountNumber()] = acc;
+                }
+            }
+        });
+    }
+
+    // Replays an opening journaled by another bank that numbers users the
+    // same way: publishes `account` for user `userId`, creating the user if
+    // this bank has none by that id. False if the number is already taken.
+    bool openReplicatedAccount(uint32_t userId, const string& name, const string& pin, Account* account) {
+        const string& accNum = account->getAccountNumber();
+        bool opened = false;
+        updateDirectory([&](DirectoryWriter& dir) {
+            DirectoryShard& shard = dir.accountShard(accNum);
+            if (shard.accounts.count(accNum)) return;
+            vector<Account*>& list = dir.userAccounts(userId);
+            User* owner = nullptr;
+            if (!list.empty()) {
+                const string& first = list.front()->getAccountNumber();
+                owner = dir.accountShard(first).users[first];
+            }
+            if (!owner) { // Never added here, or every account it had is closed
+                adoptedUsers.push_back(make_unique<User>(name, pin));
+                owner = adoptedUsers.back().get();
+                owner->setId(userId);
+                dir.reserveUserId(userId);
+            }
+            IPostingObserver* obs = postingObserver.load(memory_order_relaxed);
+            account->setObserver(obs);
+            if (obs) obs->onAccountOpened({accNum, account->getCurrency(), account->getBalance(), userId, name, pin});
+            owner->addAccount(account);
+            list.push_back(account);
+            shard.users[accNum] = owner;
+            shard.accounts[accNum] = account;
+            opened = true;
+        });
+        return opened;
+    }
+
+    // Closes an empty account. It is unlinked at once and deleted when no
+    // reader that might have looked it up is still pinned.
+    bool closeAccount(const string& accNum) { return retireAccounts({accNum}, true) == 1; }
+
+    // Closes and unlinks accounts whatever their balance, e.g. once a shard
+    // migration has copied them to another BankService; returns how many
+    size_t releaseAccounts(const vector<string>& accNums) { return retireAccounts(accNums, false); }
+
+    // Calls fn(accNum, account, owner) for every account under one epoch pin
+    template <typename Fn>
+    void forEachAccount(Fn fn) {
+        EpochGuard guard(epochs);
+        directory.load(memory_order_acquire)->forEachAccount(fn);
+    }
+
+    size_t reclaimClosedAccounts() { return epochs.tryReclaim(); }
+
+    IPostingObserver* getPostingObserver() const { return postingObserver.load(memory_order_relaxed); }
+
+    // Reports every applied posting on any account to `obs` (null to stop).
+    // Returns once nothing is still reporting to the previous observer.
+    void setPostingObserver(IPostingObserver* obs) {
+        {
+            lock_guard<mutex> lock(directoryWriteMtx); // Accounts added meanwhile pick it up too
+            postingObserver.store(obs, memory_order_release);
+            directory.load(memory_order_relaxed)->forEachAccount([&](const string&, Account* acc, User*) {
+                acc->setObserver(obs);
+            });
+        }
+        epochs.synchronize(); // Rejections report under a pin
+    }
+
+    // Keeps pointers returned by getAccount valid while the guard lives
+    EpochGuard pinAccounts() { return EpochGuard(epochs); }
+
+    AccountHandle openAccountHandle(const string& accNum) override {
+        EpochGuard guard(epochs);
+        Account* acc = lookupAccount(accNum);
+        if (!acc) return AccountHandle::unresolved(accNum);
+        acc->acquireRef(); // Safe: the epoch pin keeps `acc` alive until the ref is taken
+        return AccountHandle::adopt(acc);
+    }
+
+    // One pin and one index probe for all of the user's accounts
+    vector<AccountHandle> openUserAccounts(User* user) override {
+        vector<AccountHandle> handles;
+        EpochGuard guard(epochs);
+        const vector<Account*>* accounts = directory.load(memory_order_acquire)->userAccounts(user->getId());
+        if (!accounts) return handles;
+        for (Account* acc : *accounts) {
+            acc->acquireRef();
+            handles.push_back(AccountHandle::adopt(acc));
+        }
+        return handles;
+    }
+
+    bool deposit(const AccountHandle& h, double amount) override {
+        if (!h.isResolved()) return deposit(h.accountNumber(), amount);
+        return h->deposit(amount);
+    }
+
+    bool depositIdempotent(const string& requestId, const AccountHandle& h, double amount) override {
+        return runOnce(requestId, [&] { return deposit(h, amount); });
+    }
+
+    bool withdrawIdempotent(const string& requestId, const AccountHandle& h, double amount,
+                            const string& currency) override {
+        return runOnce(requestId, [&] { return withdrawInCurrency(h, amount, currency); });
+    }
+
+    RequestStatus getRequestStatus(const string& requestId) override {
+        lock_guard<mutex> lock(requestMtx);
+        auto it = requestOutcomes.find(requestId);
+        return it == requestOutcomes.end() ? RequestStatus::UNKNOWN : it->second;
+    }
+
+    bool keepsRequestLog() override { return true; }
+
+    // Records a request another bank refused, e.g. when replaying its journal
+    void recordRejectedRequest(const string& requestId) {
+        runOnce(requestId, [] { return false; });
+    }
+
+    bool withdraw(const AccountHandle& h, double amount) override {
+        if (!h.isResolved()) return withdraw(h.accountNumber(), amount);
+        return h->withdraw(amount);
+    }
+
+    bool withdrawInCurrency(const AccountHandle& h, double amount, const string& currency) override {
+        if (!h.isResolved()) return withdrawInCurrency(h.accountNumber(), amount, currency);
+        return withdrawFrom(h.get(), amount, currency);
+    }
+
+    double getBalance(const AccountHandle& h) override {
+        if (!h.isResolved()) return getBalance(h.accountNumber());
+        return h->getBalance();
+    }
+
+    void showTransactions(const AccountHandle& h) override {
+        if (!h.isResolved()) return showTransactions(h.accountNumber());
+        h->showTransactions();
+    }
+
+    vector<Transaction> getTransactions(const AccountHandle& h) override {
+        if (!h.isResolved()) return getTransactions(h.accountNumber());
+        return h->getTransactions();
+    }
+
+    bool deposit(const string& accNum, double amount) override {
+        EpochGuard guard(epochs);
+        Account* acc = lookupAccount(accNum);
+        if (!acc) return false;
+        return acc->deposit(amount);
+    }
+
+    bool withdraw(const string& accNum, double amount) override {
+        EpochGuard guard(epochs);
+        Account* acc = lookupAccount(accNum);
+        if (!acc) return false;
+        return acc->withdraw(amount);
+    }
+
+    bool withdrawInCurrency(const string& accNum, double amount, const string& currency) override {
+        EpochGuard guard(epochs);
+        Account* acc = lookupAccount(accNum);
+        if (!acc) return false;
+        return withdrawFrom(acc, amount, currency);
+    }
+
+    double getBalance(const string& accNum) override {
+        EpochGuard guard(epochs);
+        Account* acc = lookupAccount(accNum);
+        if (!acc) return -1;
+        return acc->getBalance();
+    }
+
+    string getCurrency(const string& accNum) override {
+        EpochGuard guard(epochs);
+        Account* acc = lookupAccount(accNum);
+        return acc ? acc->getCurrency() : "";
+    }
+
+    void showTransactions(const string& accNum) override {
+        EpochGuard guard(epochs);
+        Account* acc = lookupAccount(accNum);
+        if (acc) acc->showTransactions();
+    }
+
+    vector<Transaction> getTransactions(const string& accNum) override {
+        EpochGuard guard(epochs);
+        Account* acc = lookupAccount(accNum);
+        if (!acc) return {};
+        return acc->getTransactions();
+    }
+
+    User* getUserByAccount(const string& accNum) override {
+        EpochGuard guard(epochs);
+        return directory.load(memory_order_acquire)->findUser(accNum);
+    }
+
+    Account* getAccount(const string& accNum) override {
+        EpochGuard guard(epochs);
+        return lookupAccount(accNum);
+    }
+
+    FxRateTable& getFxRates() { return fx; }
+
+    // Converts every balance to the base currency. Balances are bucketed by
+    // currency so each bucket is one SIMD pass with a single broadcast rate.
+    BaseCurrencyReport reportInBaseCurrency() {
+        EpochGuard rates = fx.pin();
+        const FxSnapshot* snap = fx.snapshot();
+        BaseCurrencyReport report;
+        report.base = snap->base;
+        EpochGuard guard(epochs);
+        const AccountDirectory* dir = directory.load(memory_order_acquire);
+        vector<vector<double>> balances(snap->toBase.size());
+        vector<vector<string>> owners(snap->toBase.size());
+        dir->forEachAccount([&](const string& accNum, Account* acc, User*) {
+            int slot = snap->find(acc->getCurrency());
+            if (slot < 0) {
+                report.unconverted.push_back(accNum);
+                return;
+            }
+            balances[slot].push_back(acc->getBalance());
+            owners[slot].push_back(accNum);
+        });
+        for (size_t slot = 0; slot < balances.size(); slot++) {
+            size_t offset = report.converted.size();
+            report.converted.resize(offset + balances[slot].size());
+            report.total += scaleAndSum(balances[slot].data(), snap->toBase[slot],
+                                        report.converted.data() + offset, balances[slot].size());
+            report.accountNumbers.insert(report.accountNumbers.end(), owners[slot].begin(), owners[slot].end());
+        }
+        return report;
+    }
+
+    // ---- Standing orders ----
+    uint64_t addStandingOrder(const string& from, const string& to, double amount,
+                              chrono::system_clock::time_point firstDue,
+                              chrono::seconds interval = chrono::seconds(0)) {
+        lock_guard<mutex> lock(orderMtx);
+        bool wakeScheduler = orderBook.empty() || firstDue < orderBook.nextDue();
+        uint64_t id = orderBook.add(from, to, amount, firstDue, interval);
+        if (wakeScheduler) orderCv.notify_one();
+        return id;
+    }
+
+    bool cancelStandingOrder(uint64_t id) {
+        lock_guard<mutex> lock(orderMtx);
+        return orderBook.cancel(id);
+    }
+
+    // Executes every order due at `now`. Debits are grouped by source account
+    // and credits by destination account so each account lock is taken once.
+    size_t runDueOrders(chrono::system_clock::time_point now) {
+        vector<StandingOrder> due;
+        {
+            lock_guard<mutex> lock(orderMtx);
+            orderBook.popDue(now, due);
+        }
+        if (due.empty()) return 0;
+
+        EpochGuard guard(epochs);
+        vector<StandingOrder> credits;
+        vector<double> amounts;
+        vector<char> results;
+        uint64_t executed = 0, failed = 0;
+        forEachAccountGroup(due, [](const StandingOrder& o) -> const string& { return o.fromAccount; },
+            [&](size_t begin, size_t end) {
+                Account* from = lookupAccount(due[begin].fromAccount);
+                amounts.clear();
+                for (size_t i = begin; i < end; i++) amounts.push_back(due[i].amount);
+                if (from) from->withdrawBatch(amounts, results);
+                else results.assign(amounts.size(), 0);
+                for (size_t i = begin; i < end; i++) {
+                    if (!results[i - begin]) { failed++; continue; }
+                    executed++;
+                    if (!due[i].toAccount.empty()) credits.push_back(due[i]);
+                }
+            });
+        forEachAccountGroup(credits, [](const StandingOrder& o) -> const string& { return o.toAccount; },
+            [&](size_t begin, size_t end) {
+                Account* to = lookupAccount(credits[begin].toAccount);
+                amounts.clear();
+                for (size_t i = begin; i < end && to; i++) {
+                    double credited = credits[i].amount;
+                    Account* from = lookupAccount(credits[i].fromAccount);
+                    if (from && from->getCurrency() != to->getCurrency() &&
+                        !fx.convert(credited, from->getCurrency(), to->getCurrency(), credited)) {
+                        to = nullptr; // No rate: treat like a missing destination
+                        break;
+                    }
+                    amounts.push_back(credited);
+                }
+                if (to && to->depositBatch(amounts)) return;
+                // Destination closed, vanished or not convertible: refund the debits
+                for (size_t i = begin; i < end; i++) {
+                    Account* from = lookupAccount(credits[i].fromAccount);
+                    if (from) from->depositBatch({credits[i].amount});
+                    executed--;
+                    failed++;
+                }
+            });
+
+        auto finished = chrono::system_clock::now();
+        lock_guard<mutex> lock(orderMtx);
+        orderStats.executed += executed;
+        orderStats.failed += failed;
+        for (const auto& order : due) {
+            double lagMs = chrono::duration<double, milli>(finished - order.nextDue).count();
+            orderStats.totalLagMs += lagMs;
+            orderStats.maxLagMs = max(orderStats.maxLagMs, lagMs);
+        }
+        return due.size();
+    }
+
+    void startScheduler() {
+        lock_guard<mutex> lock(orderMtx);
+        if (schedulerThread.joinable()) return;
+        stopping = false;
+        schedulerThread = thread(&BankService::schedulerLoop, this);
+    }
+
+    void stopScheduler() {
+        {
+            lock_guard<mutex> lock(orderMtx);
+            if (!schedulerThread.joinable()) return;
+            stopping = true;
+        }
+        orderCv.notify_one();
+        schedulerThread.join();
+    }
+
+    StandingOrderStats getStandingOrderStats() {
+        lock_guard<mutex> lock(orderMtx);
+        return orderStats;
+    }
+};
+
+// ---------------- Forwarding BankService ----------------
+/*
+Base for services that pass each call to the backend owning the account.
+Subclasses only decide the owner; a missing owner fails the call the way
+an unknown account would. Handles stay bound to the backend that opened
+them.
+*/
+class ForwardingBankService : public IBankService {
+public:
+    // Null when no backend owns the account
+    virtual IBankService* backendFor(const string& accNum) = 0;
+    // Every backend, possibly with repeats
+    virtual vector<IBankService*> allBackends() = 0;
+
+protected:
+    // Every posting passes through here; subclasses may hold it back
+    virtual bool forwardPosting(const string& accNum, const function<bool(IBankService*)>& post) {
+        IBankService* backend = backendFor(accNum);
+        return backend && post(backend);
+    }
+
+public:
+    bool deposit(const string& accNum, double amount) override {
+        return forwardPosting(accNum, [&](IBankService* backend) { return backend->deposit(accNum, amount); });
+    }
+
+    bool withdraw(const string& accNum, double amount) override {
+        return forwardPosting(accNum, [&](IBankService* backend) { return backend->withdraw(accNum, amount); });
+    }
+
+    bool withdrawInCurrency(const string& accNum, double amount, const string& currency) override {
+        return forwardPosting(accNum, [&](IBankService* backend) {
+            return backend->withdrawInCurrency(accNum, amount, currency);
+        });
+    }
+
+    double getBalance(const string& accNum) override {
+        IBankService* backend = backendFor(accNum);
+        return backend ? backend->getBalance(accNum) : -1;
+    }
+
+    string getCurrency(const string& accNum) override {
+        IBankService* backend = backendFor(accNum);
+        return backend ? backend->getCurrency(accNum) : "";
+    }
+
+    void showTransactions(const string& accNum) override {
+        IBankService* backend = backendFor(accNum);
+        if (backend) backend->showTransactions(accNum);
+    }
+
+    vector<Transaction> getTransactions(const string& accNum) override {
+        IBankService* backend = backendFor(accNum);
+        return backend ? backend->getTransactions(accNum) : vector<Transaction>();
+    }
+
+    User* getUserByAccount(const string& accNum) override {
+        IBankService* backend = backendFor(accNum);
+        return backend ? backend->getUserByAccount(accNum) : nullptr;
+    }
+
+    Account* getAccount(const string& accNum) override {
+        IBankService* backend = backendFor(accNum);
+        return backend ? backend->getAccount(accNum) : nullptr;
+    }
+
+    bool authenticate(const string& accNum, const string& pin) override {
+        IBankService* backend = backendFor(accNum);
+        return backend && backend->authenticate(accNum, pin);
+    }
+
+    AccountHandle openAccountHandle(const string& accNum) override {
+        IBankService* backend = backendFor(accNum);
+        return backend ? backend->openAccountHandle(accNum) : AccountHandle::unresolved(accNum);
+    }
+
+    bool deposit(const AccountHandle& h, double amount) override {
+        return forwardPosting(h.accountNumber(), [&](IBankService* backend) { return backend->deposit(h, amount); });
+    }
+
+    bool withdraw(const AccountHandle& h, double amount) override {
+        return forwardPosting(h.accountNumber(), [&](IBankService* backend) { return backend->withdraw(h, amount); });
+    }
+
+    bool withdrawInCurrency(const AccountHandle& h, double amount, const string& currency) override {
+        return forwardPosting(h.accountNumber(), [&](IBankService* backend) {
+            return backend->withdrawInCurrency(h, amount, currency);
+        });
+    }
+
+    double getBalance(const AccountHandle& h) override {
+        IBankService* backend = backendFor(h.accountNumber());
+        return backend ? backend->getBalance(h) : -1;
+    }
+
+    void showTransactions(const AccountHandle& h) override {
+        IBankService* backend = backendFor(h.accountNumber());
+        if (backend) backend->showTransactions(h);
+    }
+
+    bool depositIdempotent(const string& requestId, const AccountHandle& h, double amount) override {
+        return forwardPosting(h.accountNumber(), [&](IBankService* backend) {
+            return backend->depositIdempotent(requestId, h, amount);
+        });
+    }
+
+    bool withdrawIdempotent(const string& requestId, const AccountHandle& h, double amount,
+                            const string& currency) override {
+        return forwardPosting(h.accountNumber(), [&](IBankService* backend) {
+            return backend->withdrawIdempotent(requestId, h, amount, currency);
+        });
+    }
+
+    vector<Transaction> getTransactions(const AccountHandle& h) override {
+        IBankService* backend = backendFor(h.accountNumber());
+        return backend ? backend->getTransactions(h) : vector<Transaction>();
+    }
+
+    // Request ids carry no account, so every backend is asked
+    RequestStatus getRequestStatus(const string& requestId) override {
+        vector<IBankService*> all = allBackends();
+        sort(all.begin(), all.end());
+        all.erase(unique(all.begin(), all.end()), all.end());
+        for (IBankService* backend : all) {
+            RequestStatus status = backend->getRequestStatus(requestId);
+            if (status != RequestStatus::UNKNOWN) return status;
+        }
+        return RequestStatus::UNKNOWN;
+    }
+
+    bool keepsRequestLog() override {
+        vector<IBankService*> all = allBackends();
+        return !all.empty() && all_of(all.begin(), all.end(), [](IBankService* b) { return b->keepsRequestLog(); });
+    }
+};
+
+// ---------------- Routing BankService ----------------
+/*
+An IBankService that forwards each call to one of several backends,
+chosen by the longest matching account-number prefix.
+- The route table is immutable once published; setRoutes builds a new
+  one and swaps the pointer, so traffic never pauses for a route change.
+- Readers pin an epoch only for the table lookup; replaced tables are
+  retired through EpochManager.
+*/
+class RoutingBankService : public ForwardingBankService {
+private:
+    struct RouteTable {
+        vector<string> prefixes;          // Owns the keys viewed by byPrefix
+        vector<size_t> lengths;           // Distinct prefix lengths, longest first
+        unordered_map<string_view, IBankService*> byPrefix;
+    };
+
+    EpochManager epochs;
+    atomic<const RouteTable*> table{new RouteTable()};
+    mutex writeMtx;
+
+public:
+    ~RoutingBankService() { delete table.load(); }
+
+    // Replaces the whole table; later duplicates of a prefix win
+    void setRoutes(const vector<pair<string, IBankService*>>& routes) {
+        RouteTable* next = new RouteTable();
+        next->prefixes.reserve(routes.size());
+        for (const auto& route : routes) next->prefixes.push_back(route.first);
+        for (size_t i = 0; i < routes.size(); i++) {
+            const string& prefix = next->prefixes[i];
+            next->byPrefix[string_view(prefix)] = routes[i].second;
+            if (find(next->lengths.begin(), next->lengths.end(), prefix.size()) == next->lengths.end())
+                next->lengths.push_back(prefix.size());
+        }
+        sort(next->lengths.rbegin(), next->lengths.rend());
+
+        lock_guard<mutex> lock(writeMtx);
+        const RouteTable* old = table.exchange(next, memory_order_acq_rel);
+        epochs.retire([old] { delete old; });
+        epochs.tryReclaim();
+    }
+
+    IBankService* backendFor(const string& accNum) override {
+        EpochGuard guard(epochs);
+        const RouteTable* t = table.load(memory_order_acquire);
+        string_view key(accNum);
+        for (size_t len : t->lengths) {
+            if (len > key.size()) continue;
+            auto it = t->byPrefix.find(key.substr(0, len));
+            if (it != t->byPrefix.end()) return it->second;
+        }
+        return nullptr;
+    }
+
+    vector<IBankService*> allBackends() override {
+        vector<IBankService*> backends;
+        EpochGuard guard(epochs);
+        for (const auto& [prefix, backend] : table.load(memory_order_acquire)->byPrefix) backends.push_back(backend);
+        return backends;
+    }
+};
+
+// ---------------- Partitioned BankService ----------------
+/*
+Spreads accounts over several BankService processes by consistent hashing.
+- Each partition puts `vnodes` points on a 64-bit hash ring. An account
+  belongs to the partition owning the first point at or after the hash
+  of its number. With many points per partition the shares even out, and
+  adding or removing a partition moves only the accounts next to its
+  points.
+- Calls go straight to the owner's backend, typically a RemoteBankService
+  connected to that partition's BankServer.
+- The ring is published like the routing table: an immutable snapshot
+  behind an atomic pointer, with replaced snapshots retired through
+  EpochManager.
+- Points can be paused and handed to another partition (see
+  ShardMigration). A posting to a paused point waits until it is handed
+  over. Each point counts the postings under way on it, so pausing can
+  wait for them without a pin being held across a (possibly remote) call.
+*/
+inline uint64_t hashKey(string_view key) {
+    uint64_t h = 14695981039346656037ull; // FNV-1a, then a murmur-style finalizer
+    for (char c : key) h = (h ^ (uint8_t)c) * 1099511628211ull;
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdull;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ull;
+    return h ^ (h >> 33);
+}
+
+struct HashRing {
+    vector<uint64_t> points;     // Sorted
+    vector<uint32_t> owners;     // Partition index per point
+    vector<char> paused;         // Per point: postings wait
+    vector<atomic<uint32_t>*> inFlight; // Per point: postings under way
+    vector<string> names;        // By partition index
+    vector<IBankService*> backends;
+
+    // Index of the point owning `hash`
+    size_t pointFor(uint64_t hash) const {
+        size_t i = lower_bound(points.begin(), points.end(), hash) - points.begin();
+        return i == points.size() ? 0 : i;
+    }
+
+    int partitionIndex(const string& name) const {
+        for (size_t i = 0; i < names.size(); i++) {
+            if (names[i] == name) return (int)i;
+        }
+        return -1;
+    }
+};
+
+class PartitionedBankService : public ForwardingBankService {
+private:
+    EpochManager epochs;
+    atomic<const HashRing*> ring{new HashRing()};
+    mutex writeMtx;
+    mutex pauseMtx;
+    condition_variable pauseCv; // Signalled when paused points are released
+    deque<atomic<uint32_t>> counters; // In-flight counts, kept for every point ever on the ring
+    unordered_map<uint64_t, atomic<uint32_t>*> counterOf;
+
+    // Caller holds writeMtx
+    atomic<uint32_t>* counterFor(uint64_t point) {
+        auto [it, inserted] = counterOf.try_emplace(point, nullptr);
+        if (inserted) it->second = &counters.emplace_back(0);
+        return it->second;
+    }
+
+    // Sets the pause flag on each of `pts`; false if one is not on the ring
+    bool markPaused(const vector<uint64_t>& pts, bool paused, int newOwner = -1) {
+        bool ok = updateRing([&](HashRing& r) {
+            for (uint64_t point : pts) {
+                auto it = lower_bound(r.points.begin(), r.points.end(), point);
+                if (it == r.points.end() || *it != point) return false;
+                size_t i = it - r.points.begin();
+                r.paused[i] = paused;
+                if (newOwner >= 0) r.owners[i] = (uint32_t)newOwner;
+            }
+            return true;
+        });
+        if (ok && !paused) {
+            lock_guard<mutex> lock(pauseMtx);
+            pauseCv.notify_all();
+        }
+        return ok;
+    }
+
+    // Copy-on-write update of the ring
+    template <typename Fn>
+    bool updateRing(Fn mutate) {
+        lock_guard<mutex> lock(writeMtx);
+        const HashRing* old = ring.load(memory_order_relaxed);
+        HashRing* next = new HashRing(*old);
+        if (!mutate(*next)) {
+            delete next;
+            return false;
+        }
+        ring.store(next, memory_order_release);
+        epochs.retire([old] { delete old; });
+        epochs.tryReclaim();
+        return true;
+    }
+
+public:
+    ~PartitionedBankService() { delete ring.load(); }
+
+    // Fails if the name is taken
+    bool addPartition(const string& name, IBankService* backend, unsigned vnodes = 128) {
+        return updateRing([&](HashRing& r) {
+            if (r.partitionIndex(name) >= 0) return false;
+            uint32_t index = (uint32_t)r.names.size();
+            r.names.push_back(name);
+            r.backends.push_back(backend);
+            vector<tuple<uint64_t, uint32_t, char>> merged;
+            for (size_t i = 0; i < r.points.size(); i++) merged.push_back({r.points[i], r.owners[i], r.paused[i]});
+            for (unsigned v = 0; v < vnodes; v++) merged.push_back({hashKey(name + "#" + to_string(v)), index, 0});
+            sort(merged.begin(), merged.end());
+            r.points.clear();
+            r.owners.clear();
+            r.paused.clear();
+            r.inFlight.clear();
+            for (const auto& [point, owner, paused] : merged) {
+                r.points.push_back(point);
+                r.owners.push_back(owner);
+                r.paused.push_back(paused);
+                r.inFlight.push_back(counterFor(point));
+            }
+            return true;
+        });
+    }
+
+    // Its accounts fall to the partitions owning the next points
+    bool removePartition(const string& name) {
+        return updateRing([&](HashRing& r) {
+            int index = r.partitionIndex(name);
+            if (index < 0) return false;
+            size_t kept = 0;
+            for (size_t i = 0; i < r.points.size(); i++) {
+                if (r.owners[i] == (uint32_t)index) continue;
+                r.points[kept] = r.points[i];
+                r.paused[kept] = r.paused[i];
+                r.inFlight[kept] = r.inFlight[i];
+                r.owners[kept++] = r.owners[i];
+            }
+            r.points.resize(kept);
+            r.owners.resize(kept);
+            r.paused.resize(kept);
+            r.inFlight.resize(kept);
+            r.names[index].clear(); // Indexes stay stable; the name may be reused
+            r.backends[index] = nullptr;
+            return true;
+        });
+    }
+
+    // The points a partition owns, e.g. to hand some of them to another
+    vector<uint64_t> pointsOf(const string& name) {
+        EpochGuard guard(epochs);
+        const HashRing* r = ring.load(memory_order_acquire);
+        vector<uint64_t> pts;
+        int index = r->partitionIndex(name);
+        for (size_t i = 0; index >= 0 && i < r->points.size(); i++) {
+            if (r->owners[i] == (uint32_t)index) pts.push_back(r->points[i]);
+        }
+        return pts;
+    }
+
+    // The backend of the partition owning `point`; null if it is not on the ring
+    IBankService* backendOfPoint(uint64_t point) {
+        EpochGuard guard(epochs);
+        const HashRing* r = ring.load(memory_order_acquire);
+        auto it = lower_bound(r->points.begin(), r->points.end(), point);
+        return it == r->points.end() || *it != point ? nullptr : r->backends[r->owners[it - r->points.begin()]];
+    }
+
+    // Null if there is no such partition
+    IBankService* partitionBackend(const string& name) {
+        EpochGuard guard(epochs);
+        const HashRing* r = ring.load(memory_order_acquire);
+        int index = r->partitionIndex(name);
+        return index < 0 ? nullptr : r->backends[index];
+    }
+
+    // The ring point an account falls on
+    uint64_t pointOf(const string& accNum) {
+        EpochGuard guard(epochs);
+        const HashRing* r = ring.load(memory_order_acquire);
+        return r->points.empty() ? 0 : r->points[r->pointFor(hashKey(accNum))];
+    }
+
+    // Holds back new postings to accounts on `pts` and returns once the
+    // postings already under way have finished
+    bool pauseWrites(const vector<uint64_t>& pts) {
+        if (!markPaused(pts, true)) return false;
+        epochs.synchronize(); // Postings that saw the points open have counted themselves
+        vector<atomic<uint32_t>*> underWay;
+        {
+            EpochGuard guard(epochs);
+            const HashRing* r = ring.load(memory_order_acquire);
+            for (uint64_t point : pts)
+                underWay.push_back(r->inFlight[lower_bound(r->points.begin(), r->points.end(), point) - r->points.begin()]);
+        }
+        for (atomic<uint32_t>* n : underWay) {
+            while (n->load(memory_order_acquire) != 0) this_thread::sleep_for(chrono::microseconds(100));
+        }
+        return true;
+    }
+
+    void resumeWrites(const vector<uint64_t>& pts) { markPaused(pts, false); }
+
+    // Gives `pts` to partition `toName` and releases the postings waiting on them
+    bool transferPoints(const vector<uint64_t>& pts, const string& toName) {
+        int index;
+        {
+            EpochGuard guard(epochs);
+            index = ring.load(memory_order_acquire)->partitionIndex(toName);
+        }
+        return index >= 0 && markPaused(pts, false, index);
+    }
+
+    IBankService* backendFor(const string& accNum) override {
+        EpochGuard guard(epochs);
+        const HashRing* r = ring.load(memory_order_acquire);
+        if (r->points.empty()) return nullptr;
+        return r->backends[r->owners[r->pointFor(hashKey(accNum))]];
+    }
+
+    // Accounts can move between partitions, so handles are never bound to one
+    AccountHandle openAccountHandle(const string& accNum) override { return AccountHandle::unresolved(accNum); }
+
+    string partitionOf(const string& accNum) {
+        EpochGuard guard(epochs);
+        const HashRing* r = ring.load(memory_order_acquire);
+        if (r->points.empty()) return "";
+        return r->names[r->owners[r->pointFor(hashKey(accNum))]];
+    }
+
+    vector<IBankService*> allBackends() override {
+        EpochGuard guard(epochs);
+        vector<IBankService*> backends;
+        for (IBankService* b : ring.load(memory_order_acquire)->backends) {
+            if (b) backends.push_back(b);
+        }
+        return backends;
+    }
+
+protected:
+    bool forwardPosting(const string& accNum, const function<bool(IBankService*)>& post) override {
+        uint64_t hash = hashKey(accNum);
+        for (;;) {
+            IBankService* backend = nullptr;
+            atomic<uint32_t>* underWay = nullptr;
+            {
+                EpochGuard guard(epochs); // Pinned while counting in; see pauseWrites
+                const HashRing* r = ring.load(memory_order_acquire);
+                if (r->points.empty()) return false;
+                size_t i = r->pointFor(hash);
+                if (!r->paused[i]) {
+                    backend = r->backends[r->owners[i]];
+                    if (!backend) return false;
+                    underWay = r->inFlight[i];
+                    underWay->fetch_add(1, memory_order_relaxed);
+                }
+            }
+            if (underWay) {
+                bool ok = post(backend);
+                underWay->fetch_sub(1, memory_order_release);
+                return ok;
+            }
+            unique_lock<mutex> lock(pauseMtx);
+            pauseCv.wait_for(lock, chrono::milliseconds(1));
+        }
+    }
+};
+
+// ---------------- Shard Migration ----------------
+/*
+Moves a set of ring points, and the accounts on them, from one partition's
+BankService to another's while ATMs keep posting through the router.
+- Capture: the migration observes the source and records, per account,
+  every posting to an account on the moving points.
+- Copy: each account is copied with its balance and history. The copy is
+  taken under the account lock and marks how many captured postings it
+  already contains.
+- Catch-up: captured postings past that mark are replayed on the target,
+  round after round, until a round has little left to do.
+- Flip: the router pauses the points and waits out postings in flight, the
+  last postings are replayed, and one ring update hands the points to the
+  target. Only this step holds postings back.
+- The source then releases its copies of the moved accounts.
+Both services must be in this process. Accounts must not be opened on the
+moving points and partitions must not be added or removed meanwhile.
+Standing orders and idempotent request outcomes stay with the source, and
+postings made on the source directly rather than through the router are
+not held back.
+*/
+struct MigrationStats {
+    bool completed = false; // False: nothing moved and the source still serves the points
+    size_t accounts = 0;   // Accounts moved
+    size_t replayed = 0;   // Captured postings replayed on the target
+    int rounds = 0;        // Catch-up rounds before the flip
+    double copyMs = 0;
+    double catchUpMs = 0;
+    double pauseMs = 0;    // Postings to the moving points were held back this long
+    double totalMs = 0;
+};
+
+class ShardMigration : public IPostingObserver {
+private:
+    struct Captured {
+        vector<pair<TransactionType, double>> postings;
+        size_t applied = 0;    // Postings already on the target
+        Account* copy = nullptr; // Null until copied
+    };
+
+    BankService& source;
+    BankService& target;
+    PartitionedBankService& router;
+    vector<uint64_t> points;
+    string targetName;
+    unordered_set<uint64_t> moving;
+    IPostingObserver* previous = nullptr;
+    mutex mtx; // Guards `captured`; taken under the account lock
+    unordered_map<string, Captured> captured;
+    MigrationStats stats;
+
+    static double msSince(chrono::steady_clock::time_point start) {
+        return chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+    }
+
+    // Copies every account on the moving points to the target
+    void copyAccounts() {
+        unordered_map<User*, User*> users; // Source user -> its copy on the target
+        vector<User*> copies;
+        source.forEachAccount([&](const string& accNum, Account* acc, User* owner) {
+            if (!moving.count(router.pointOf(accNum))) return;
+            Account* copy = nullptr;
+            acc->inspect([&](double balance, const vector<Transaction>& history) {
+                copy = new Account(accNum, balance, acc->getCurrency(), history);
+                lock_guard<mutex> lock(mtx);
+                Captured& c = captured[accNum];
+                c.applied = c.postings.size();
+                c.copy = copy;
+            });
+            User*& user = users[owner]; // Every published account has an owner
+            if (!user) {
+                user = owner->copyWithoutAccounts();
+                copies.push_back(user);
+            }
+            user->addAccount(copy);
+            stats.accounts++;
+        });
+        target.addUsers(copies);
+    }
+
+    // Replays captured postings not yet on the target; returns how many
+    size_t catchUp() {
+        vector<pair<Account*, vector<pair<TransactionType, double>>>> work;
+        {
+            lock_guard<mutex> lock(mtx);
+            for (auto& [accNum, c] : captured) {
+                if (!c.copy || c.applied == c.postings.size()) continue;
+                work.push_back({c.copy, {c.postings.begin() + c.applied, c.postings.end()}});
+                c.applied = c.postings.size();
+            }
+        }
+        size_t n = 0;
+        for (const auto& [acc, postings] : work) {
+            for (const auto& [type, amount] : postings) {
+                type == TransactionType::DEPOSIT ? acc->deposit(amount) : acc->withdraw(amount);
+                n++;
+            }
+        }
+        return n;
+    }
+
+public:
+    // `points` must belong to the source's partition; `targetName` names the
+    // target's partition on the router
+    ShardMigration(BankService& src, BankService& dst, PartitionedBankService& partitioned,
+                   vector<uint64_t> pts, string toName)
+        : source(src), target(dst), router(partitioned), points(move(pts)), targetName(move(toName)),
+          moving(points.begin(), points.end()) {}
+
+    void onPosting(const Posting& posting) override {
+        if (moving.count(router.pointOf(string(posting.accountNumber)))) {
+            lock_guard<mutex> lock(mtx);
+            captured[string(posting.accountNumber)].postings.push_back({posting.type, posting.amount});
+        }
+        if (previous) previous->onPosting(posting);
+    }
+
+    void onRejectedRequest(string_view requestId) override {
+        if (previous) previous->onRejectedRequest(requestId);
+    }
+
+    void onAccountOpened(const AccountOpening& opening) override {
+        if (previous) previous->onAccountOpened(opening);
+    }
+
+    void onAccountClosed(string_view accountNumber) override {
+        if (previous) previous->onAccountClosed(accountNumber);
+    }
+
+    // Runs the migration. Catch-up rounds continue until one replays at most
+    // `flipBacklog` postings or `maxRounds` have run. Fails before copying
+    // anything unless the source owns every point and `targetName` names
+    // the target, and undoes the copy if the router refuses the handover.
+    MigrationStats run(size_t flipBacklog = 256, int maxRounds = 16) {
+        auto start = chrono::steady_clock::now();
+        if (&source == &target || points.empty() || router.partitionBackend(targetName) != &target) return stats;
+        for (uint64_t point : points) {
+            if (router.backendOfPoint(point) != &source) return stats;
+        }
+        previous = source.getPostingObserver();
+        source.setPostingObserver(this);
+
+        copyAccounts();
+        stats.copyMs = msSince(start);
+
+        auto catchUpStart = chrono::steady_clock::now();
+        while (stats.rounds < maxRounds) {
+            stats.rounds++;
+            size_t n = catchUp();
+            stats.replayed += n;
+            if (n <= flipBacklog) break;
+        }
+        stats.catchUpMs = msSince(catchUpStart);
+
+        auto pauseStart = chrono::steady_clock::now();
+        bool handedOver = router.pauseWrites(points);
+        if (handedOver) {
+            stats.replayed += catchUp();
+            handedOver = router.transferPoints(points, targetName);
+            if (!handedOver) router.resumeWrites(points);
+        }
+        stats.pauseMs = msSince(pauseStart);
+
+        source.setPostingObserver(previous); // Waits out postings still reporting to us
+        vector<string> moved;
+        for (const auto& [accNum, c] : captured) {
+            if (c.copy) moved.push_back(accNum);
+        }
+        if (handedOver) {
+            source.releaseAccounts(moved);
+        } else {
+            target.releaseAccounts(moved); // The source's accounts stay authoritative
+            stats.accounts = 0;
+        }
+        stats.completed = handedOver;
+        stats.totalMs = msSince(start);
+        return stats;
+    }
+};
+
+// ---------------- Cross-Partition Transfers ----------------
+/*
+Moves money between two accounts that may live on different partitions,
+as an escrow-style two-phase commit run by TransferCoordinator.
+- Prepare: the credit account must exist, and the amount is withdrawn
+  from the debit account into escrow (the hold). Held money cannot be
+  spent twice, so no lock has to span the partitions.
+- Commit deposits the amount to the credit account. Abort refunds the
+  hold if it was applied.
+- Every step is an idempotent posting whose request id derives from the
+  transfer id, so a step can be repeated safely and the participant's
+  request log tells whether it was applied.
+- The checks that need no posting (amount, account numbers, currencies,
+  the credit account existing) run before BEGIN is logged. A transfer
+  failing them aborts with no log record, so neither commit nor recovery
+  ever sends a hold for it.
+- The coordinator log is an append-only file. BEGIN is durable before the
+  hold is sent, and the decision is durable before phase two; END is
+  written lazily. Concurrent transfers share each fdatasync (group
+  commit). A batch runs every phase for all its transfers before the
+  next, so its prepares go out behind one log flush.
+- On startup the log is read back. recover() aborts transfers that had
+  no decision yet (presumed abort) and completes decided ones.
+Participants must keep a request log (BankService, or a BankServer in
+front of one) and still remember a transfer's ids when it is recovered.
+Both accounts must hold the same currency; transfers between currencies
+are refused, since there is no rate to credit the other side at.
+*/
+enum class TransferOutcome { COMMITTED, ABORTED, IN_DOUBT };
+
+struct TransferRequest {
+    string from;
+    string to;
+    double amount;
+};
+
+struct TransferStats {
+    uint64_t committed = 0;
+    uint64_t aborted = 0;
+    uint64_t inDoubt = 0;   // Awaiting recover()
+    uint64_t recovered = 0; // In-doubt transfers recover() settled
+    uint64_t logSyncs = 0;
+};
+
+// Makes a rename into the directory holding `path` durable
+inline bool syncParentDir(const string& path) {
+    size_t slash = path.rfind('/');
+    string dir = slash == string::npos ? "." : slash == 0 ? "/" : path.substr(0, slash);
+    int fd = open(dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0) return false;
+    bool ok = fsync(fd) == 0;
+    close(fd);
+    return ok;
+}
+
+// Append-only file; sync() returns once a record is on disk and lets one
+// caller flush everything appended so far on behalf of the others
+class CoordinatorLog {
+private:
+    int fd;
+    mutex mtx;
+    condition_variable cv;
+    string pending;
+    uint64_t appended = 0;
+    uint64_t durable = 0;
+    bool flushing = false;
+    bool failed = false;
+    uint64_t syncs = 0;
+
+public:
+    explicit CoordinatorLog(const string& path)
+        : fd(open(path.c_str(), O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0600)) {}
+    CoordinatorLog(const CoordinatorLog&) = delete;
+    CoordinatorLog& operator=(const CoordinatorLog&) = delete;
+    ~CoordinatorLog() {
+        sync(appended);
+        if (fd >= 0) close(fd);
+    }
+
+    bool isOpen() const { return fd >= 0; }
+
+    // Returns the record's sequence number for sync()
+    uint64_t append(const string& record) {
+        lock_guard<mutex> lock(mtx);
+        pending += record;
+        return ++appended;
+    }
+
+    bool sync(uint64_t seq) {
+        unique_lock<mutex> lock(mtx);
+        while (durable < seq && !failed) {
+            if (flushing) {
+                cv.wait(lock);
+                continue;
+            }
+            flushing = true;
+            string batch;
+            batch.swap(pending);
+            uint64_t upTo = appended;
+            lock.unlock();
+            bool ok = fd >= 0;
+            for (size_t off = 0; ok && off < batch.size();) {
+                ssize_t n = write(fd, batch.data() + off, batch.size() - off);
+                if (n < 0 && errno == EINTR) continue;
+                ok = n > 0;
+                off += ok ? n : 0;
+            }
+            ok = ok && fdatasync(fd) == 0;
+            lock.lock();
+            flushing = false;
+            syncs++;
+            if (ok) durable = upTo;
+            else failed = true; // A torn record is skipped when the log is read back
+            cv.notify_all();
+        }
+        return durable >= seq;
+    }
+
+    uint64_t syncCount() {
+        lock_guard<mutex> lock(mtx);
+        return syncs;
+    }
+};
+
+class TransferCoordinator {
+private:
+    struct Transfer {
+        uint64_t id = 0;
+        string from;
+        string to;
+        int64_t amountMinor = 0;
+        char decision = 0; // 'C', 'A' or 0 while undecided
+    };
+
+    ForwardingBankService& bank;
+    string name;
+    unique_ptr<CoordinatorLog> log;
+    atomic<uint64_t> nextId{1};
+    mutex mtx; // Guards inDoubt and stats
+    unordered_map<uint64_t, Transfer> inDoubt;
+    TransferStats stats;
+
+    string requestId(const Transfer& t, char step) const { return name + ":" + to_string(t.id) + ":" + step; }
+
+    static string beginRecord(const Transfer& t) {
+        return "B " + to_string(t.id) + " " + t.from + " " + t.to + " " + to_string(t.amountMinor) + "\n";
+    }
+
+    static bool loggable(const string& accNum) {
+        return !accNum.empty() && accNum.size() < 64 && accNum.find_first_of(" \n") == string::npos;
+    }
+
+    static string stepRecord(char kind, uint64_t id) { return string(1, kind) + " " + to_string(id) + "\n"; }
+
+    // Reads back the log; returns the transfers without an END record
+    static unordered_map<uint64_t, Transfer> readLog(const string& path, uint64_t& nextId) {
+        unordered_map<uint64_t, Transfer> open;
+        FILE* f = fopen(path.c_str(), "r");
+        if (!f) return open;
+        char buf[256];
+        while (fgets(buf, sizeof buf, f)) {
+            char kind, from[64], to[64];
+            unsigned long long id;
+            long long cents;
+            if (!strchr(buf, '\n') || sscanf(buf, "%c %llu", &kind, &id) != 2) continue; // Torn record
+            nextId = max(nextId, kind == 'N' ? (uint64_t)id : (uint64_t)id + 1);
+            if (kind == 'B' && sscanf(buf, "B %*u %63s %63s %lld", from, to, &cents) == 3) {
+                open[id] = {id, from, to, cents, 0};
+            } else if ((kind == 'C' || kind == 'A') && open.count(id)) {
+                open[id].decision = kind;
+            } else if (kind == 'E') {
+                open.erase(id);
+            }
+        }
+        fclose(f);
+        return open;
+    }
+
+    // Finds out whether the hold was applied. An unknown hold is sent again,
+    // so a copy still on its way is dropped as a repeat.
+    bool settleHold(const Transfer& t, bool& applied) {
+        IBankService* backend = bank.backendFor(t.from);
+        if (!backend) return false;
+        string id = requestId(t, 'H');
+        for (int attempt = 0; attempt < 100; attempt++) {
+            switch (backend->getRequestStatus(id)) {
+                case RequestStatus::APPLIED:
+                    applied = true;
+                    return true;
+                case RequestStatus::REJECTED:
+                    applied = false;
+                    return true;
+                case RequestStatus::IN_FLIGHT:
+                    this_thread::sleep_for(chrono::milliseconds(1));
+                    break;
+                case RequestStatus::UNKNOWN:
+                    if (attempt >= 3) return false; // Participant unreachable
+                    bank.withdrawIdempotent(id, AccountHandle::unresolved(t.from), t.amountMinor / 100.0, "");
+                    break;
+            }
+        }
+        return false;
+    }
+
+    // Phase two; false leaves the transfer in doubt
+    bool finish(const Transfer& t) {
+        double amount = t.amountMinor / 100.0;
+        if (t.decision == 'C')
+            return bank.depositIdempotent(requestId(t, 'C'), AccountHandle::unresolved(t.to), amount);
+        bool held = false;
+        if (!settleHold(t, held)) return false;
+        return !held || bank.depositIdempotent(requestId(t, 'R'), AccountHandle::unresolved(t.from), amount);
+    }
+
+public:
+    // `coordinatorName` prefixes the request ids and must be unique among
+    // coordinators. Transfers left open in the log at `logPath` wait for
+    // recover().
+    TransferCoordinator(ForwardingBankService& service, const string& logPath, string coordinatorName)
+        : bank(service), name(move(coordinatorName)) {
+        uint64_t next = 1;
+        inDoubt = readLog(logPath, next);
+        nextId = next;
+        stats.inDoubt = inDoubt.size();
+        // Compact: keep only the id counter and the open transfers
+        string tmpPath = logPath + ".tmp";
+        unlink(tmpPath.c_str()); // Left over from a compaction that never got renamed
+        {
+            CoordinatorLog fresh(tmpPath);
+            uint64_t seq = fresh.append(stepRecord('N', next));
+            for (const auto& [id, t] : inDoubt) {
+                seq = fresh.append(beginRecord(t));
+                if (t.decision) seq = fresh.append(stepRecord(t.decision, id));
+            }
+            if (fresh.sync(seq) && rename(tmpPath.c_str(), logPath.c_str()) == 0) syncParentDir(logPath);
+        }
+        log = make_unique<CoordinatorLog>(logPath);
+    }
+
+    bool isOpen() const { return log->isOpen(); }
+
+    // Runs the transfers together, phase by phase
+    vector<TransferOutcome> transferBatch(const vector<TransferRequest>& requests) {
+        size_t n = requests.size();
+        vector<Transfer> transfers(n);
+        vector<TransferOutcome> outcomes(n, TransferOutcome::ABORTED);
+        // Transfers failing a check are never logged, so no hold goes out for them
+        vector<char> checked(n);
+        uint64_t seq = 0;
+        for (size_t i = 0; i < n; i++) {
+            Transfer& t = transfers[i];
+            t.id = nextId.fetch_add(1);
+            t.from = requests[i].from;
+            t.to = requests[i].to;
+            t.amountMinor = llround(requests[i].amount * 100);
+            if (t.amountMinor <= 0 || !loggable(t.from) || !loggable(t.to)) continue;
+            string currency = bank.getCurrency(t.to); // Empty also for an unknown account
+            checked[i] = !currency.empty() && bank.getCurrency(t.from) == currency;
+            if (checked[i]) seq = log->append(beginRecord(t));
+        }
+        size_t refused = count(checked.begin(), checked.end(), 0);
+        if (seq == 0 || !log->sync(seq)) {
+            lock_guard<mutex> lock(mtx);
+            stats.aborted += n; // Nothing was posted
+            return outcomes;
+        }
+        vector<char> votes(n);
+        for (size_t i = 0; i < n; i++) {
+            const Transfer& t = transfers[i];
+            if (checked[i])
+                votes[i] = bank.withdrawIdempotent(requestId(t, 'H'), AccountHandle::unresolved(t.from),
+                                                   t.amountMinor / 100.0, "");
+        }
+
+        for (size_t i = 0; i < n; i++) {
+            if (!checked[i]) continue;
+            transfers[i].decision = votes[i] ? 'C' : 'A';
+            seq = log->append(stepRecord(transfers[i].decision, transfers[i].id));
+        }
+        bool decided = log->sync(seq);
+
+        vector<char> finished(n);
+        for (size_t i = 0; i < n; i++) {
+            finished[i] = checked[i] && decided && finish(transfers[i]);
+            if (finished[i]) log->append(stepRecord('E', transfers[i].id));
+        }
+        lock_guard<mutex> lock(mtx);
+        stats.aborted += refused;
+        for (size_t i = 0; i < n; i++) {
+            Transfer& t = transfers[i];
+            if (!checked[i]) continue; // ABORTED without a posting
+            if (finished[i]) {
+                outcomes[i] = t.decision == 'C' ? TransferOutcome::COMMITTED : TransferOutcome::ABORTED;
+                (t.decision == 'C' ? stats.committed : stats.aborted)++;
+            } else {
+                if (!decided) t.decision = 0; // Only the log knows whether the decision stuck
+                outcomes[i] = TransferOutcome::IN_DOUBT;
+                inDoubt[t.id] = t;
+                stats.inDoubt++;
+            }
+        }
+        return outcomes;
+    }
+
+    TransferOutcome transfer(const string& from, const string& to, double amount) {
+        return transferBatch({{from, to, amount}})[0];
+    }
+
+    // Settles in-doubt transfers; returns how many remain
+    size_t recover() {
+        lock_guard<mutex> lock(mtx);
+        for (auto it = inDoubt.begin(); it != inDoubt.end();) {
+            Transfer& t = it->second;
+            if (!t.decision) {
+                if (!log->sync(log->append(stepRecord('A', t.id)))) break; // Presumed abort, once durable
+                t.decision = 'A';
+            }
+            if (!finish(t)) {
+                ++it;
+                continue;
+            }
+            log->append(stepRecord('E', t.id));
+            stats.recovered++;
+            (t.decision == 'C' ? stats.committed : stats.aborted)++;
+            it = inDoubt.erase(it);
+        }
+        stats.inDoubt = inDoubt.size();
+        return inDoubt.size();
+    }
+
+    TransferStats getStats() {
+        lock_guard<mutex> lock(mtx);
+        TransferStats s = stats;
+        s.logSyncs = log->syncCount();
+        return s;
+    }
+};
+
+// ---------------- Admission Control ----------------
+/*
+Puts a BankService behind a fixed number of execution slots so that ATM
+customers keep their latency while batch jobs overload it.
+- Each call belongs to a request class: postings and logins are CUSTOMER,
+  balance lookups INTERACTIVE, histories and statements BULK. Request
+  status lookups bypass admission, since the ATM decides from them
+  whether a posting may be retried.
+  A thread can move its calls to another class with RequestClassScope,
+  e.g. a batch job reading balances.
+- A call runs on the caller's thread once it holds a slot. When none is
+  free it waits in its class's bounded queue; a full queue rejects it.
+  Freed slots go to the highest class with waiters, and a call never
+  takes a free slot while a higher class has waiters. A class may be
+  capped below the slot count; by default BULK leaves one slot for the
+  others. With a single slot BULK only gets it when no one else waits.
+- Classes with a delay target shed in CoDel style: once waiters have
+  queued longer than the target for a whole interval, waiters are shed
+  at the head of the queue, more often while the delay stays high, until
+  it drops back below the target.
+- Rejected and shed calls fail as the backend would (false, -1, an empty
+  history), so callers need no new error path.
+*/
+enum class RequestClass { CUSTOMER, INTERACTIVE, BULK };
+
+struct RequestClassConfig {
+    size_t queueCapacity = 256;
+    int maxRunning = 0;                  // Slots the class may hold; 0: all
+    chrono::microseconds delayTarget{0}; // 0: never shed
+    chrono::microseconds interval{100000};
+};
+
+struct RequestClassStats {
+    uint64_t admitted = 0;
+    uint64_t rejected = 0; // Queue full
+    uint64_t shed = 0;     // Queued too long
+    size_t queued = 0;     // Waiting now
+    double totalQueueUs = 0;
+    double maxQueueUs = 0;
+    double totalServiceUs = 0;
+    double averageQueueUs() const { return admitted ? totalQueueUs / admitted : 0; }
+    double averageServiceUs() const { return admitted ? totalServiceUs / admitted : 0; }
+};
+
+// Overrides the class of calls made by this thread while alive
+class RequestClassScope {
+private:
+    static inline thread_local int current = -1;
+    int saved;
+
+public:
+    explicit RequestClassScope(RequestClass cls) : saved(current) { current = (int)cls; }
+    RequestClassScope(const RequestClassScope&) = delete;
+    RequestClassScope& operator=(const RequestClassScope&) = delete;
+    ~RequestClassScope() { current = saved; }
+
+    static RequestClass effective(RequestClass byCall) { return current < 0 ? byCall : (RequestClass)current; }
+};
+
+class AdmissionControlledBankService : public IBankService {
+public:
+    static const int CLASSES = 3;
+
+private:
+    using Clock = chrono::steady_clock;
+
+    struct Waiter {
+        condition_variable cv;
+        Clock::time_point enqueued;
+        bool granted = false;
+        bool shed = false;
+    };
+
+    struct ClassState {
+        RequestClassConfig config;
+        deque<Waiter*> queue;
+        RequestClassStats stats;
+        int running = 0;
+        // CoDel
+        Clock::time_point firstAbove{};
+        Clock::time_point dropNext{};
+        uint32_t dropCount = 0;
+        bool dropping = false;
+    };
+
+    IBankService& backend;
+    int slots;
+    int running = 0;
+    mutex mtx; // Guards everything above and below
+    ClassState classes[CLASSES];
+
+    static double usBetween(Clock::time_point from, Clock::time_point to) {
+        return chrono::duration<double, micro>(to - from).count();
+    }
+
+    // Caller holds mtx. Whether the waiter at the head, queued for `sojourn`, goes.
+    static bool shouldShed(ClassState& c, Clock::duration sojourn, Clock::time_point now) {
+        if (c.config.delayTarget.count() == 0) return false;
+        if (sojourn < c.config.delayTarget) {
+            c.firstAbove = {};
+            c.dropping = false;
+            return false;
+        }
+        if (!c.dropping) {
+            if (c.firstAbove == Clock::time_point{}) {
+                c.firstAbove = now + c.config.interval;
+                return false;
+            }
+            if (now < c.firstAbove) return false;
+            c.dropping = true;
+            c.dropCount = 0;
+            c.dropNext = now;
+        }
+        if (now < c.dropNext) return false;
+        c.dropCount++;
+        c.dropNext = now + chrono::duration_cast<Clock::duration>(c.config.interval / sqrt((double)c.dropCount));
+        return true;
+    }
+
+    bool atLimit(const ClassState& c) const { return c.config.maxRunning > 0 && c.running >= c.config.maxRunning; }
+
+    // Caller holds mtx
+    bool higherWaiting(const ClassState& c) const {
+        for (const ClassState* h = classes; h < &c; h++) {
+            if (!h->queue.empty()) return true;
+        }
+        return false;
+    }
+
+    // Caller holds mtx and a slot is free: hands it to the best waiter
+    void grantNext() {
+        Clock::time_point now = Clock::now();
+        for (ClassState& c : classes) {
+            while (!c.queue.empty() && !atLimit(c)) {
+                Waiter* w = c.queue.front();
+                c.queue.pop_front();
+                if (shouldShed(c, now - w->enqueued, now)) {
+                    c.stats.shed++;
+                    w->shed = true;
+                    w->cv.notify_one();
+                    continue;
+                }
+                double queuedUs = usBetween(w->enqueued, now);
+                c.stats.admitted++;
+                c.stats.totalQueueUs += queuedUs;
+                c.stats.maxQueueUs = max(c.stats.maxQueueUs, queuedUs);
+                running++;
+                c.running++;
+                w->granted = true;
+                w->cv.notify_one();
+                return;
+            }
+        }
+    }
+
+    // Runs `call` in a slot; returns `failed` if the request is turned away
+    template <typename T, typename Fn>
+    T admit(RequestClass byCall, T failed, Fn call) {
+        ClassState& c = classes[(int)RequestClassScope::effective(byCall)];
+        {
+            unique_lock<mutex> lock(mtx);
+            if (running < slots && !atLimit(c) && c.queue.empty() && !higherWaiting(c)) {
+                running++;
+                c.running++;
+                c.stats.admitted++;
+            } else if (c.queue.size() >= c.config.queueCapacity) {
+                c.stats.rejected++;
+                return failed;
+            } else {
+                Waiter w;
+                w.enqueued = Clock::now();
+                c.queue.push_back(&w);
+                w.cv.wait(lock, [&] { return w.granted || w.shed; });
+                if (w.shed) return failed;
+            }
+        }
+        Clock::time_point start = Clock::now();
+        T result = call();
+        lock_guard<mutex> lock(mtx);
+        c.stats.totalServiceUs += usBetween(start, Clock::now());
+        running--;
+        c.running--;
+        grantNext();
+        return result;
+    }
+
+public:
+    // At most `maxConcurrent` calls reach `service` at once
+    explicit AdmissionControlledBankService(IBankService& service, int maxConcurrent = 4)
+        : backend(service), slots(max(1, maxConcurrent)) {
+        classes[(int)RequestClass::CUSTOMER].config = {1024, 0, chrono::microseconds(0), chrono::microseconds(100000)};
+        classes[(int)RequestClass::INTERACTIVE].config = {256, 0, chrono::microseconds(50000),
+                                                          chrono::microseconds(100000)};
+        classes[(int)RequestClass::BULK].config = {64, slots > 1 ? slots - 1 : 0, chrono::microseconds(5000),
+                                                   chrono::microseconds(100000)};
+    }
+
+    void configure(RequestClass cls, const RequestClassConfig& config) {
+        lock_guard<mutex> lock(mtx);
+        classes[(int)cls].config = config;
+    }
+
+    RequestClassStats getStats(RequestClass cls) {
+        lock_guard<mutex> lock(mtx);
+        RequestClassStats s = classes[(int)cls].stats;
+        s.queued = classes[(int)cls].queue.size();
+        return s;
+    }
+
+    bool deposit(const string& accNum, double amount) override {
+        return admit(RequestClass::CUSTOMER, false, [&] { return backend.deposit(accNum, amount); });
+    }
+
+    bool withdraw(const string& accNum, double amount) override {
+        return admit(RequestClass::CUSTOMER, false, [&] { return backend.withdraw(accNum, amount); });
+    }
+
+    bool withdrawInCurrency(const string& accNum, double amount, const string& currency) override {
+        return admit(RequestClass::CUSTOMER, false,
+                     [&] { return backend.withdrawInCurrency(accNum, amount, currency); });
+    }
+
+    double getBalance(const string& accNum) override {
+        return admit(RequestClass::INTERACTIVE, -1.0, [&] { return backend.getBalance(accNum); });
+    }
+
+    string getCurrency(const string& accNum) override { return backend.getCurrency(accNum); }
+
+    void showTransactions(const string& accNum) override {
+        admit(RequestClass::BULK, false, [&] {
+            backend.showTransactions(accNum);
+            return true;
+        });
+    }
+
+    vector<Transaction> getTransactions(const string& accNum) override {
+        return admit(RequestClass::BULK, vector<Transaction>(), [&] { return backend.getTransactions(accNum); });
+    }
+
+    // Local lookups; they do not take a slot
+    User* getUserByAccount(const string& accNum) override { return backend.getUserByAccount(accNum); }
+    Account* getAccount(const string& accNum) override { return backend.getAccount(accNum); }
+    AccountHandle openAccountHandle(const string& accNum) override { return backend.openAccountHandle(accNum); }
+    vector<AccountHandle> openUserAccounts(User* user) override { return backend.openUserAccounts(user); }
+
+    bool authenticate(const string& accNum, const string& pin) override {
+        return admit(RequestClass::CUSTOMER, false, [&] { return backend.authenticate(accNum, pin); });
+    }
+
+    bool deposit(const AccountHandle& h, double amount) override {
+        return admit(RequestClass::CUSTOMER, false, [&] { return backend.deposit(h, amount); });
+    }
+
+    bool withdraw(const AccountHandle& h, double amount) override {
+        return admit(RequestClass::CUSTOMER, false, [&] { return backend.withdraw(h, amount); });
+    }
+
+    bool withdrawInCurrency(const AccountHandle& h, double amount, const string& currency) override {
+        return admit(RequestClass::CUSTOMER, false, [&] { return backend.withdrawInCurrency(h, amount, currency); });
+    }
+
+    double getBalance(const AccountHandle& h) override {
+        return admit(RequestClass::INTERACTIVE, -1.0, [&] { return backend.getBalance(h); });
+    }
+
+    void showTransactions(const AccountHandle& h) override {
+        admit(RequestClass::BULK, false, [&] {
+            backend.showTransactions(h);
+            return true;
+        });
+    }
+
+    vector<Transaction> getTransactions(const AccountHandle& h) override {
+        return admit(RequestClass::BULK, vector<Transaction>(), [&] { return backend.getTransactions(h); });
+    }
+
+    bool depositIdempotent(const string& requestId, const AccountHandle& h, double amount) override {
+        return admit(RequestClass::CUSTOMER, false, [&] { return backend.depositIdempotent(requestId, h, amount); });
+    }
+
+    bool withdrawIdempotent(const string& requestId, const AccountHandle& h, double amount,
+                            const string& currency) override {
+        return admit(RequestClass::CUSTOMER, false,
+                     [&] { return backend.withdrawIdempotent(requestId, h, amount, currency); });
+    }
+
+    // Never queued or shed: a turned-away lookup would read as UNKNOWN,
+    // which with a request log means "not processed" and invites a retry
+    RequestStatus getRequestStatus(const string& requestId) override { return backend.getRequestStatus(requestId); }
+
+    bool keepsRequestLog() override { return backend.keepsRequestLog(); }
+};
+
+// ---------------- Shared-Memory BankService ----------------
+/*
+An account store in a POSIX shared-memory segment, so several ATM driver
+processes on one host post against the same accounts directly.
+- Everything in the segment is addressed by offsets (OffsetPtr), never by
+  raw pointers, so each process may map it at a different address.
+- Each account record has its own robust, process-shared mutex. If a
+  client dies holding it, the next locker gets EOWNERDEAD and rolls back
+  the half-done posting from the record's undo slot before going on. The
+  undo slot also keeps the history entry the posting overwrites.
+- Lookups probe an open-addressing index without locking: a record is
+  fully written before its slot number is published. Inserts are
+  serialized by a robust mutex in the header, and find the owner's id
+  through a second index by owner name that only inserts use.
+- The segment is sized up front: a fixed number of accounts, each keeping
+  its most recent `historyCapacity` transactions.
+- Users are rebuilt per process from the owner name and PIN stored with
+  each record; getAccount() returns null because no Account object exists.
+*/
+template <typename T>
+class OffsetPtr {
+private:
+    int64_t offset = 0; // From this field to the target; 0 means null
+
+public:
+    void set(T* target) {
+        offset = target ? (char*)target - (char*)this : 0;
+    }
+    T* get() const {
+        return offset ? (T*)((char*)this + offset) : nullptr;
+    }
+    T& operator[](size_t i) const { return get()[i]; }
+};
+
+// Locks a robust mutex; `recover` repairs the guarded state if the
+// previous owner died holding it
+class RobustLock {
+private:
+    pthread_mutex_t* mtx;
+    bool locked = false;
+
+public:
+    template <typename Fn>
+    RobustLock(pthread_mutex_t* m, Fn recover) : mtx(m) {
+        int rc = pthread_mutex_lock(mtx);
+        if (rc == EOWNERDEAD) {
+            recover();
+            pthread_mutex_consistent(mtx);
+            rc = 0;
+        }
+        locked = rc == 0;
+    }
+    RobustLock(const RobustLock&) = delete;
+    RobustLock& operator=(const RobustLock&) = delete;
+    ~RobustLock() {
+        if (locked) pthread_mutex_unlock(mtx);
+    }
+    bool ok() const { return locked; }
+};
+
+struct SharedTransaction {
+    uint8_t type; // TransactionType
+    double amount;
+    int64_t when;
+};
+
+struct SharedAccountRecord {
+    char accountNumber[32];
+    char ownerName[32];
+    char pin[16];
+    char currency[8];
+    uint32_t ownerId;
+    pthread_mutex_t mtx;
+    // Guarded by mtx
+    double balance;
+    bool closed;
+    uint64_t postings; // Total ever recorded; the ring keeps the latest
+    struct {
+        bool active;
+        double balance;
+        uint64_t postings;
+        uint32_t historySlot;
+        SharedTransaction overwritten; // history[historySlot] before the posting
+    } undo; // State before the posting in progress
+    OffsetPtr<SharedTransaction> history;
+};
+
+struct SharedBankHeader {
+    static const uint64_t MAGIC = 0x4154'4d53'484d'0002; // "ATMSHM" v2
+
+    atomic<uint64_t> magic; // Stored last by the creator
+    uint64_t segmentBytes;
+    uint32_t capacity;
+    uint32_t historyCapacity;
+    uint32_t bucketMask;
+    pthread_mutex_t insertMtx;
+    atomic<uint32_t> count;
+    OffsetPtr<SharedAccountRecord> records;
+    OffsetPtr<atomic<uint32_t>> buckets; // Record index + 1; 0 is empty
+    OffsetPtr<uint32_t> owners; // By owner name: index + 1 of the owner's first record (under insertMtx)
+};
+
+class SharedBankService : public IBankService {
+private:
+    string name;
+    int fd = -1;
+    SharedBankHeader* header = nullptr;
+    FxRateTable fx;
+    unordered_map<uint32_t, unique_ptr<User>> users; // Per-process, by owner id
+    mutex usersMtx;
+
+    static uint32_t hashAccount(string_view accNum) {
+        uint32_t h = 2166136261u; // FNV-1a
+        for (char c : accNum) h = (h ^ (uint8_t)c) * 16777619u;
+        return h;
+    }
+
+    static void copyField(char* dst, size_t size, const string& src) {
+        size_t n = min(src.size(), size - 1);
+        memcpy(dst, src.data(), n);
+        dst[n] = '\0';
+    }
+
+    SharedAccountRecord* find(const string& accNum) const {
+        if (!header) return nullptr;
+        uint32_t mask = header->bucketMask;
+        for (uint32_t i = hashAccount(accNum) & mask;; i = (i + 1) & mask) {
+            uint32_t slot = header->buckets[i].load(memory_order_acquire);
+            if (slot == 0) return nullptr;
+            SharedAccountRecord* rec = &header->records[slot - 1];
+            if (accNum == rec->accountNumber) return rec;
+        }
+    }
+
+    // Rolls back a posting whose process died before it finished
+    static void rollBack(SharedAccountRecord* rec) {
+        if (!rec->undo.active) return;
+        rec->history[rec->undo.historySlot] = rec->undo.overwritten;
+        rec->balance = rec->undo.balance;
+        rec->postings = rec->undo.postings;
+        rec->undo.active = false;
+    }
+
+    bool post(SharedAccountRecord* rec, TransactionType type, double amount) {
+        RobustLock lock(&rec->mtx, [rec] { rollBack(rec); });
+        if (!lock.ok() || rec->closed) return false;
+        if (type == TransactionType::WITHDRAW && amount > rec->balance) return false;
+        uint32_t slot = rec->postings % header->historyCapacity;
+        SharedTransaction& t = rec->history[slot];
+        rec->undo.balance = rec->balance;
+        rec->undo.postings = rec->postings;
+        rec->undo.historySlot = slot;
+        rec->undo.overwritten = t;
+        rec->undo.active = true;
+        t.type = (uint8_t)type;
+        t.amount = amount;
+        t.when = (int64_t)time(0);
+        rec->balance += type == TransactionType::DEPOSIT ? amount : -amount;
+        rec->postings++;
+        rec->undo.active = false;
+        return true;
+    }
+
+    static void initRobustMutex(pthread_mutex_t* m) {
+        pthread_mutexattr_t attr;
+        pthread_mutexattr_init(&attr);
+        pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+        pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+        pthread_mutex_init(m, &attr);
+        pthread_mutexattr_destroy(&attr);
+    }
+
+    bool mapSegment(size_t bytes, int prot) {
+        void* base = mmap(nullptr, bytes, prot, MAP_SHARED, fd, 0);
+        if (base == MAP_FAILED) return false;
+        header = (SharedBankHeader*)base;
+        return true;
+    }
+
+    void create(uint32_t capacity, uint32_t historyCapacity) {
+        uint32_t buckets = 1;
+        while (buckets < capacity * 2) buckets <<= 1;
+        size_t recordsAt = (sizeof(SharedBankHeader) + 63) & ~size_t(63);
+        size_t bucketsAt = recordsAt + capacity * sizeof(SharedAccountRecord);
+        size_t ownersAt = bucketsAt + buckets * sizeof(uint32_t);
+        size_t historyAt = (ownersAt + buckets * sizeof(uint32_t) + 63) & ~size_t(63);
+        size_t bytes = historyAt + (size_t)capacity * historyCapacity * sizeof(SharedTransaction);
+        if (ftruncate(fd, bytes) != 0 || !mapSegment(bytes, PROT_READ | PROT_WRITE)) {
+            close(fd); // Nobody can attach to a segment without a header
+            fd = -1;
+            shm_unlink(name.c_str());
+            return;
+        }
+
+        char* base = (char*)header;
+        header->segmentBytes = bytes;
+        header->capacity = capacity;
+        header->historyCapacity = historyCapacity;
+        header->bucketMask = buckets - 1;
+        initRobustMutex(&header->insertMtx);
+        header->count.store(0, memory_order_relaxed);
+        header->records.set((SharedAccountRecord*)(base + recordsAt));
+        header->buckets.set((atomic<uint32_t>*)(base + bucketsAt));
+        header->owners.set((uint32_t*)(base + ownersAt));
+        for (uint32_t i = 0; i < capacity; i++) {
+            header->records[i].history.set(
+                (SharedTransaction*)(base + historyAt) + (size_t)i * historyCapacity);
+        }
+        header->magic.store(SharedBankHeader::MAGIC, memory_order_release);
+    }
+
+    void attach() {
+        struct stat st;
+        if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(SharedBankHeader)) return;
+        if (!mapSegment(st.st_size, PROT_READ | PROT_WRITE)) return;
+        if (header->magic.load(memory_order_acquire) != SharedBankHeader::MAGIC) {
+            munmap(header, st.st_size); // Not ours, or its creator has not finished
+            header = nullptr;
+        }
+    }
+
+public:
+    // With capacity > 0, creates the segment `segmentName` (which must not
+    // exist yet); otherwise attaches to an existing one. Check isOpen().
+    explicit SharedBankService(const string& segmentName, uint32_t capacity = 0,
+                               uint32_t historyCapacity = 64)
+        : name(segmentName) {
+        if (capacity > 0) {
+            fd = shm_open(name.c_str(), O_CREAT | O_EXCL | O_RDWR, 0600);
+            if (fd >= 0) create(capacity, max(historyCapacity, 1u));
+        } else {
+            fd = shm_open(name.c_str(), O_RDWR, 0600);
+            if (fd >= 0) attach();
+        }
+    }
+
+    SharedBankService(const SharedBankService&) = delete;
+    SharedBankService& operator=(const SharedBankService&) = delete;
+
+    // Unmaps only; the segment lives until remove()
+    ~SharedBankService() {
+        if (header) munmap(header, header->segmentBytes);
+        if (fd >= 0) close(fd);
+    }
+
+    static bool remove(const string& segmentName) { return shm_unlink(segmentName.c_str()) == 0; }
+
+    bool isOpen() const { return header != nullptr; }
+
+    // Adds an account owned by `ownerName`; accounts with the same owner
+    // name form one user. Fails when full or the number is taken.
+    bool addAccount(const string& accNum, const string& ownerName, const string& pin,
+                    double balance, const string& currency = "USD") {
+        if (!header || accNum.empty() || accNum.size() >= sizeof(SharedAccountRecord::accountNumber))
+            return false;
+        RobustLock lock(&header->insertMtx, [] {}); // Inserts publish last, so nothing to repair
+        if (!lock.ok() || find(accNum)) return false;
+        uint32_t index = header->count.load(memory_order_relaxed);
+        if (index == header->capacity) return false;
+
+        SharedAccountRecord* rec = &header->records[index];
+        copyField(rec->accountNumber, sizeof(rec->accountNumber), accNum);
+        copyField(rec->ownerName, sizeof(rec->ownerName), ownerName);
+        copyField(rec->pin, sizeof(rec->pin), pin);
+        copyField(rec->currency, sizeof(rec->currency), currency);
+        uint32_t mask = header->bucketMask;
+        uint32_t owner = hashAccount(rec->ownerName) & mask; // Stops at the owner's slot or a free one
+        for (; header->owners[owner] != 0; owner = (owner + 1) & mask) {
+            if (strcmp(header->records[header->owners[owner] - 1].ownerName, rec->ownerName) == 0) break;
+        }
+        bool newOwner = header->owners[owner] == 0;
+        rec->ownerId = newOwner ? index : header->records[header->owners[owner] - 1].ownerId;
+        initRobustMutex(&rec->mtx);
+        rec->balance = balance;
+        rec->closed = false;
+        rec->postings = 0;
+        rec->undo.active = false;
+
+        uint32_t i = hashAccount(accNum) & mask;
+        while (header->buckets[i].load(memory_order_relaxed) != 0) i = (i + 1) & mask;
+        header->buckets[i].store(index + 1, memory_order_release);
+        header->count.store(index + 1, memory_order_release);
+        if (newOwner) header->owners[owner] = index + 1;
+        return true;
+    }
+
+    // Only an empty account can be closed; later operations on it fail
+    bool closeAccount(const string& accNum) {
+        SharedAccountRecord* rec = find(accNum);
+        if (!rec) return false;
+        RobustLock lock(&rec->mtx, [rec] { rollBack(rec); });
+        if (!lock.ok() || rec->closed || rec->balance != 0) return false;
+        rec->closed = true;
+        return true;
+    }
+
+    FxRateTable& getFxRates() { return fx; }
+
+    bool deposit(const string& accNum, double amount) override {
+        SharedAccountRecord* rec = find(accNum);
+        return rec && post(rec, TransactionType::DEPOSIT, amount);
+    }
+
+    bool withdraw(const string& accNum, double amount) override {
+        SharedAccountRecord* rec = find(accNum);
+        return rec && post(rec, TransactionType::WITHDRAW, amount);
+    }
+
+    bool withdrawInCurrency(const string& accNum, double amount, const string& currency) override {
+        SharedAccountRecord* rec = find(accNum);
+        if (!rec) return false;
+        double posted = amount;
+        if (!currency.empty() && currency != rec->currency &&
+            !fx.convert(amount, currency, rec->currency, posted))
+            return false; // No exchange rate
+        return post(rec, TransactionType::WITHDRAW, posted);
+    }
+
+    double getBalance(const string& accNum) override {
+        SharedAccountRecord* rec = find(accNum);
+        if (!rec) return -1;
+        RobustLock lock(&rec->mtx, [rec] { rollBack(rec); });
+        return lock.ok() ? rec->balance : -1;
+    }
+
+    string getCurrency(const string& accNum) override {
+        SharedAccountRecord* rec = find(accNum);
+        return rec ? string(rec->currency) : ""; // Fixed when the record is created
+    }
+
+    vector<Transaction> getTransactions(const string& accNum) override {
+        vector<Transaction> out;
+        SharedAccountRecord* rec = find(accNum);
+        if (!rec) return out;
+        RobustLock lock(&rec->mtx, [rec] { rollBack(rec); });
+        if (!lock.ok()) return out;
+        uint64_t kept = min<uint64_t>(rec->postings, header->historyCapacity);
+        for (uint64_t i = rec->postings - kept; i < rec->postings; i++) {
+            const SharedTransaction& t = rec->history[i % header->historyCapacity];
+            out.emplace_back((TransactionType)t.type, t.amount, (time_t)t.when);
+        }
+        return out;
+    }
+
+    void showTransactions(const string& accNum) override {
+        vector<Transaction> transactions = getTransactions(accNum);
+        if (transactions.empty()) {
+            cout << "No transactions yet.\n";
+            return;
+        }
+        cout << "Transaction history for account " << accNum << ":\n";
+        for (const auto& t : transactions) t.show();
+    }
+
+    User* getUserByAccount(const string& accNum) override {
+        SharedAccountRecord* rec = find(accNum);
+        if (!rec) return nullptr;
+        lock_guard<mutex> lock(usersMtx);
+        auto& user = users[rec->ownerId];
+        if (!user) {
+            user = make_unique<User>(rec->ownerName, rec->pin);
+            user->setId(rec->ownerId);
+        }
+        return user.get();
+    }
+
+    Account* getAccount(const string&) override { return nullptr; }
+
+    vector<AccountHandle> openUserAccounts(User* user) override {
+        vector<AccountHandle> handles;
+        if (!header) return handles;
+        uint32_t count = header->count.load(memory_order_acquire);
+        for (uint32_t i = 0; i < count; i++) {
+            const SharedAccountRecord& rec = header->records[i];
+            if (rec.ownerId == user->getId()) handles.push_back(AccountHandle::unresolved(rec.accountNumber));
+        }
+        return handles;
+    }
+};
+
+// ---------------- Card Registry ----------------
+/*
+Routes a card number to the backend and account that serve it.
+- Issuer routing uses the card's BIN (its first 6 digits) against a
+  sorted table of non-overlapping [low, high] BIN ranges. Each entry is
+  12 bytes, so a binary search over hundreds of issuers touches only a
+  few cache lines and takes well under a microsecond.
+- Individual cards map to their account number in a hash table.
+*/
+struct CardRoute {
+    IBankService* backend = nullptr;
+    string accountNumber;
+
+    bool found() const { return backend && !accountNumber.empty(); }
+};
+
+class CardRegistry {
+public:
+    static const int BIN_DIGITS = 6;
+
+private:
+    struct BinRange {
+        uint32_t low;
+        uint32_t high;
+        uint32_t backend; // Index into backends
+    };
+
+    vector<BinRange> ranges; // Sorted by low
+    vector<IBankService*> backends;
+    unordered_map<string, string> cardToAccount;
+
+public:
+    static bool parseBin(const string& cardNumber, uint32_t& bin) {
+        if (cardNumber.size() < BIN_DIGITS) return false;
+        bin = 0;
+        for (int i = 0; i < BIN_DIGITS; i++) {
+            char c = cardNumber[i];
+            if (c < '0' || c > '9') return false;
+            bin = bin * 10 + (c - '0');
+        }
+        return true;
+    }
+
+    // Fails if the range overlaps one already registered
+    bool addIssuerRange(uint32_t lowBin, uint32_t highBin, IBankService* backend) {
+        if (lowBin > highBin) return false;
+        auto pos = lower_bound(ranges.begin(), ranges.end(), lowBin,
+                               [](const BinRange& r, uint32_t bin) { return r.low < bin; });
+        if (pos != ranges.end() && pos->low <= highBin) return false;
+        if (pos != ranges.begin() && prev(pos)->high >= lowBin) return false;
+        auto slot = find(backends.begin(), backends.end(), backend);
+        uint32_t index = (uint32_t)(slot - backends.begin());
+        if (slot == backends.end()) backends.push_back(backend);
+        ranges.insert(pos, {lowBin, highBin, index});
+        return true;
+    }
+
+    void registerCard(const string& cardNumber, const string& accNum) {
+        cardToAccount[cardNumber] = accNum;
+    }
+
+    IBankService* routeBin(uint32_t bin) const {
+        auto it = upper_bound(ranges.begin(), ranges.end(), bin,
+                              [](uint32_t b, const BinRange& r) { return b < r.low; });
+        if (it == ranges.begin()) return nullptr;
+        --it;
+        return bin <= it->high ? backends[it->backend] : nullptr;
+    }
+
+    CardRoute route(const string& cardNumber) const {
+        CardRoute result;
+        uint32_t bin;
+        if (!parseBin(cardNumber, bin)) return result;
+        auto card = cardToAccount.find(cardNumber);
+        if (card == cardToAccount.end()) return result;
+        result.backend = routeBin(bin);
+        result.accountNumber = card->second;
+        return result;
+    }
+};
+
+// ---------------- ATM Wire Messages ----------------
+/*
+ISO 8583-style binary format for ATM <-> bank traffic.
+- Layout: 2-byte MTI, 8-byte primary bitmap (field 1 = most significant
+  bit, as in ISO 8583), then the present fields in ascending order.
+  All integers are big-endian.
+- Fixed fields have a fixed width; LLVAR fields carry a 1-byte length and
+  LLLVAR fields a 2-byte length.
+- encodeMessage writes into a caller-provided buffer and decodeMessage
+  returns string_views into the input buffer, so neither allocates.
+*/
+enum class AtmMti : uint16_t {
+    LOGIN_REQUEST = 0x0100,
+    LOGIN_RESPONSE = 0x0110,
+    BALANCE_REQUEST = 0x0200,
+    BALANCE_RESPONSE = 0x0210,
+    DEPOSIT_REQUEST = 0x0220,
+    DEPOSIT_RESPONSE = 0x0230,
+    WITHDRAW_REQUEST = 0x0240,
+    WITHDRAW_RESPONSE = 0x0250,
+    HISTORY_REQUEST = 0x0300,
+    HISTORY_RESPONSE = 0x0310,
+    STATUS_REQUEST = 0x0320,  // Outcome of an idempotent request; FIELD_AMOUNT carries the RequestStatus
+    STATUS_RESPONSE = 0x0330,
+};
+
+enum AtmField {
+    FIELD_ACCOUNT = 2,        // LLVAR, up to 32 bytes
+    FIELD_AMOUNT = 4,         // int64, minor units (cents)
+    FIELD_STAN = 11,          // uint32 system trace audit number
+    FIELD_TIMESTAMP = 12,     // uint64, microseconds since the epoch
+    FIELD_REQUEST_ID = 37,    // LLVAR, up to 48 bytes; makes a posting idempotent
+    FIELD_RESPONSE_CODE = 39, // uint8, 0 = approved
+    FIELD_HISTORY = 48,       // LLLVAR, packed HISTORY_ENTRY_SIZE records
+    FIELD_CURRENCY = 49,      // 3 bytes, ISO currency code
+    FIELD_PIN = 52,           // LLVAR, up to 12 bytes
+};
+
+enum AtmResponseCode : uint8_t {
+    RESPONSE_APPROVED = 0,
+    RESPONSE_DECLINED = 1,
+    RESPONSE_UNKNOWN_ACCOUNT = 2,
+    RESPONSE_INSUFFICIENT_FUNDS = 3,
+    RESPONSE_NOT_PRIMARY = 4, // Fenced: retry against the current primary
+};
+
+struct AtmMessage {
+    static const size_t MAX_ACCOUNT = 32;
+    static const size_t MAX_PIN = 12;
+    static const size_t MAX_REQUEST_ID = 48;
+    static const size_t HISTORY_ENTRY_SIZE = 9; // 1-byte TransactionType + int64 amount
+
+    AtmMti mti = AtmMti::LOGIN_REQUEST;
+    uint64_t bitmap = 0;
+    string_view account;
+    int64_t amountMinor = 0;
+    uint32_t stan = 0;
+    uint64_t timestamp = 0;
+    string_view requestId;
+    uint8_t responseCode = RESPONSE_APPROVED;
+    string_view history;
+    string_view currency;
+    string_view pin;
+
+    static uint64_t bit(int field) { return 1ULL << (64 - field); }
+    bool has(int field) const { return bitmap & bit(field); }
+    void set(int field) { bitmap |= bit(field); }
+};
+
+namespace wire {
+inline void put(uint8_t*& p, uint64_t value, int bytes) {
+    for (int i = bytes - 1; i >= 0; i--) *p++ = (uint8_t)(value >> (8 * i));
+}
+
+inline uint64_t get(const uint8_t*& p, int bytes) {
+    uint64_t value = 0;
+    for (int i = 0; i < bytes; i++) value = (value << 8) | *p++;
+    return value;
+}
+
+inline bool putVar(uint8_t*& p, const uint8_t* end, string_view data, int lenBytes, size_t maxLen) {
+    if (data.size() > maxLen || end - p < (ptrdiff_t)(lenBytes + data.size())) return false;
+    put(p, data.size(), lenBytes);
+    memcpy(p, data.data(), data.size());
+    p += data.size();
+    return true;
+}
+
+inline bool getVar(const uint8_t*& p, const uint8_t* end, string_view& out, int lenBytes, size_t maxLen) {
+    if (end - p < lenBytes) return false;
+    size_t len = get(p, lenBytes);
+    if (len > maxLen || end - p < (ptrdiff_t)len) return false;
+    out = string_view((const char*)p, len);
+    p += len;
+    return true;
+}
+} // namespace wire
+
+// Returns the encoded size, or 0 if the buffer is too small or a field is invalid
+inline size_t encodeMessage(const AtmMessage& msg, uint8_t* buf, size_t capacity) {
+    uint8_t* p = buf;
+    const uint8_t* end = buf + capacity;
+    auto room = [&](size_t n) { return end - p >= (ptrdiff_t)n; };
+    if (!room(10)) return 0;
+    wire::put(p, (uint16_t)msg.mti, 2);
+    wire::put(p, msg.bitmap, 8);
+    if (msg.has(FIELD_ACCOUNT) && !wire::putVar(p, end, msg.account, 1, AtmMessage::MAX_ACCOUNT)) return 0;
+    if (msg.has(FIELD_AMOUNT)) {
+        if (!room(8)) return 0;
+        wire::put(p, (uint64_t)msg.amountMinor, 8);
+    }
+    if (msg.has(FIELD_STAN)) {
+        if (!room(4)) return 0;
+        wire::put(p, msg.stan, 4);
+    }
+    if (msg.has(FIELD_TIMESTAMP)) {
+        if (!room(8)) return 0;
+        wire::put(p, msg.timestamp, 8);
+    }
+    if (msg.has(FIELD_REQUEST_ID) && !wire::putVar(p, end, msg.requestId, 1, AtmMessage::MAX_REQUEST_ID))
+        return 0;
+    if (msg.has(FIELD_RESPONSE_CODE)) {
+        if (!room(1)) return 0;
+        wire::put(p, msg.responseCode, 1);
+    }
+    if (msg.has(FIELD_HISTORY) &&
+        (msg.history.size() % AtmMessage::HISTORY_ENTRY_SIZE != 0 ||
+         !wire::putVar(p, end, msg.history, 2, UINT16_MAX))) return 0;
+    if (msg.has(FIELD_CURRENCY)) {
+        if (msg.currency.size() != 3 || !room(3)) return 0;
+        memcpy(p, msg.currency.data(), 3);
+        p += 3;
+    }
+    if (msg.has(FIELD_PIN) && !wire::putVar(p, end, msg.pin, 1, AtmMessage::MAX_PIN)) return 0;
+    return p - buf;
+}
+
+// Views in `out` point into `buf`, which must outlive them
+inline bool decodeMessage(const uint8_t* buf, size_t len, AtmMessage& out) {
+    const uint8_t* p = buf;
+    const uint8_t* end = buf + len;
+    auto room = [&](size_t n) { return end - p >= (ptrdiff_t)n; };
+    if (!room(10)) return false;
+    out = AtmMessage();
+    out.mti = (AtmMti)wire::get(p, 2);
+    out.bitmap = wire::get(p, 8);
+    const uint64_t known = AtmMessage::bit(FIELD_ACCOUNT) | AtmMessage::bit(FIELD_AMOUNT) |
+                           AtmMessage::bit(FIELD_STAN) | AtmMessage::bit(FIELD_TIMESTAMP) |
+                           AtmMessage::bit(FIELD_REQUEST_ID) | AtmMessage::bit(FIELD_RESPONSE_CODE) | AtmMessage::bit(FIELD_HISTORY) |
+                           AtmMessage::bit(FIELD_CURRENCY) | AtmMessage::bit(FIELD_PIN);
+    if (out.bitmap & ~known) return false;
+    if (out.has(FIELD_ACCOUNT) && !wire::getVar(p, end, out.account, 1, AtmMessage::MAX_ACCOUNT)) return false;
+    if (out.has(FIELD_AMOUNT)) {
+        if (!room(8)) return false;
+        out.amountMinor = (int64_t)wire::get(p, 8);
+    }
+    if (out.has(FIELD_STAN)) {
+        if (!room(4)) return false;
+        out.stan = (uint32_t)wire::get(p, 4);
+    }
+    if (out.has(FIELD_TIMESTAMP)) {
+        if (!room(8)) return false;
+        out.timestamp = wire::get(p, 8);
+    }
+    if (out.has(FIELD_REQUEST_ID) && !wire::getVar(p, end, out.requestId, 1, AtmMessage::MAX_REQUEST_ID))
+        return false;
+    if (out.has(FIELD_RESPONSE_CODE)) {
+        if (!room(1)) return false;
+        out.responseCode = (uint8_t)wire::get(p, 1);
+    }
+    if (out.has(FIELD_HISTORY) &&
+        (!wire::getVar(p, end, out.history, 2, UINT16_MAX) ||
+         out.history.size() % AtmMessage::HISTORY_ENTRY_SIZE != 0)) return false;
+    if (out.has(FIELD_CURRENCY)) {
+        if (!room(3)) return false;
+        out.currency = string_view((const char*)p, 3);
+        p += 3;
+    }
+    if (out.has(FIELD_PIN) && !wire::getVar(p, end, out.pin, 1, AtmMessage::MAX_PIN)) return false;
+    return p == end;
+}
+
+// Packs one history entry into `buf` (HISTORY_ENTRY_SIZE bytes)
+inline void encodeHistoryEntry(uint8_t* buf, TransactionType type, int64_t amountMinor) {
+    wire::put(buf, (uint8_t)type, 1);
+    wire::put(buf, (uint64_t)amountMinor, 8);
+}
+
+// Calls fn(type, amountMinor) for each entry of a decoded history field
+template <typename Fn>
+void forEachHistoryEntry(string_view history, Fn fn) {
+    const uint8_t* p = (const uint8_t*)history.data();
+    for (size_t i = 0; i + AtmMessage::HISTORY_ENTRY_SIZE <= history.size(); i += AtmMessage::HISTORY_ENTRY_SIZE) {
+        TransactionType type = (TransactionType)wire::get(p, 1);
+        fn(type, (int64_t)wire::get(p, 8));
+    }
+}
+
+// ---------------- Fencing ----------------
+/*
+The cluster-wide primary term and endpoint, kept in a small file that
+every process on the host maps.
+- Promotion claims the next term with a compare-and-set under a robust
+  process-shared mutex, so of two followers racing for the same dead
+  primary only one wins.
+- Servers run every posting under the token's mutex after checking that
+  their own term is still current, so a claim cannot slip in between the
+  check and the posting; a deposed primary refuses postings as soon as a
+  follower is promoted. Reads only compare the term (one atomic load).
+- Clients read the endpoint to find the primary after a failure.
+*/
+struct FencingState {
+    static const uint64_t MAGIC = 0x4154'4d46'454e'0001; // "ATMFEN" v1
+
+    atomic<uint64_t> magic; // Set before the file appears under its name
+    atomic<uint64_t> term;  // 0 until the first primary claims term 1
+    pthread_mutex_t mtx;    // Guards claims and endpoint
+    char endpoint[108];     // Socket path of the current primary
+};
+
+class FencingToken {
+private:
+    FencingState* state = nullptr;
+
+    static FencingState* mapState(int fd) {
+        void* base = mmap(nullptr, sizeof(FencingState), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        close(fd);
+        return base == MAP_FAILED ? nullptr : (FencingState*)base;
+    }
+
+    // Initializes the token under a private name and links it into place,
+    // so no other process can map it before it is complete. False with
+    // errno EEXIST when another process created it first.
+    bool create(const string& path) {
+        string tmp = path + "." + to_string(getpid()) + ".tmp";
+        unlink(tmp.c_str()); // Left by a process that died with our pid
+        int fd = open(tmp.c_str(), O_CREAT | O_EXCL | O_RDWR | O_CLOEXEC, 0600);
+        if (fd < 0) return false;
+        if (ftruncate(fd, sizeof(FencingState)) != 0) {
+            close(fd);
+            unlink(tmp.c_str());
+            return false;
+        }
+        FencingState* st = mapState(fd);
+        if (!st) {
+            unlink(tmp.c_str());
+            return false;
+        }
+        pthread_mutexattr_t attr;
+        pthread_mutexattr_init(&attr);
+        pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+        pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+        pthread_mutex_init(&st->mtx, &attr);
+        pthread_mutexattr_destroy(&attr);
+        st->magic.store(FencingState::MAGIC, memory_order_release);
+        bool linked = link(tmp.c_str(), path.c_str()) == 0; // Unlike rename, never replaces a token
+        int err = errno;
+        unlink(tmp.c_str());
+        if (!linked) {
+            munmap(st, sizeof(FencingState));
+            errno = err;
+            return false;
+        }
+        state = st;
+        return true;
+    }
+
+    void attach(const string& path) {
+        int fd = open(path.c_str(), O_RDWR | O_CLOEXEC);
+        if (fd < 0) return;
+        struct stat st;
+        if (fstat(fd, &st) != 0 || st.st_size < (off_t)sizeof(FencingState)) {
+            close(fd);
+            return;
+        }
+        state = mapState(fd);
+        if (state && state->magic.load(memory_order_acquire) != FencingState::MAGIC) {
+            munmap(state, sizeof(FencingState));
+            state = nullptr;
+        }
+    }
+
+public:
+    // Creates the token file at `path` or maps the existing one; check isOpen()
+    explicit FencingToken(const string& path) {
+        if (!create(path) && errno == EEXIST) attach(path);
+    }
+
+    FencingToken(const FencingToken&) = delete;
+    FencingToken& operator=(const FencingToken&) = delete;
+
+    ~FencingToken() {
+        if (state) munmap(state, sizeof(FencingState));
+    }
+
+    static bool remove(const string& path) { return unlink(path.c_str()) == 0; }
+
+    bool isOpen() const { return state != nullptr; }
+
+    uint64_t term() const { return state ? state->term.load(memory_order_acquire) : 0; }
+
+    string primary() const {
+        if (!state) return "";
+        RobustLock lock(&state->mtx, [] {}); // Claims write the endpoint before the term
+        return lock.ok() ? string(state->endpoint) : "";
+    }
+
+    // Runs `fn` with no claim able to interleave; false without running it
+    // once `expectedTerm` is no longer current
+    template <typename Fn>
+    bool whileCurrent(uint64_t expectedTerm, Fn fn) {
+        if (!state) return false;
+        RobustLock lock(&state->mtx, [] {});
+        if (!lock.ok() || state->term.load(memory_order_relaxed) != expectedTerm) return false;
+        fn();
+        return true;
+    }
+
+    // Becomes primary at `endpoint` if the term is still `expectedTerm`
+    bool claim(uint64_t expectedTerm, const string& endpoint, uint64_t& newTerm) {
+        if (!state || endpoint.size() >= sizeof(state->endpoint)) return false;
+        RobustLock lock(&state->mtx, [] {});
+        if (!lock.ok() || state->term.load(memory_order_relaxed) != expectedTerm) return false;
+        memcpy(state->endpoint, endpoint.c_str(), endpoint.size() + 1);
+        newTerm = expectedTerm + 1;
+        state->term.store(newTerm, memory_order_release);
+        return true;
+    }
+};
+
+// ---------------- Replication ----------------
+/*
+Primary-follower replication by shipping the posting journal.
+- JournalShipper observes the primary's postings. Each one gets the next
+  sequence number and is appended, already encoded, to an in-memory
+  journal. Numbering happens under the account lock, so every account's
+  postings replay in the order the primary applied them.
+- A sender thread streams the journal to followers over a Unix socket.
+  A connecting follower first sends the last sequence it applied and that
+  entry's term, so it can join late or reconnect and catch up. The shipper
+  answers with the primary's fencing term and turns the follower away if
+  it is ahead of the journal or its last entry came from another term:
+  its history has diverged and it must be rebuilt from the primary.
+- The journal is held in fixed-size chunks. The sender writes straight
+  from them with the lock released, so postings never wait behind a
+  follower's catch-up. Once the journal passes its size limit the oldest
+  chunk is dropped; a follower that still needed it is cut off and, like
+  one that connects too late, must be rebuilt. Snapshots are out of scope.
+- FollowerBankService applies entries to its own BankService, which must
+  start from the same accounts as the primary. It serves balance and
+  history reads and refuses postings until it is promoted. Promotion
+  claims the term after the one it followed, so a follower still
+  connected to a deposed primary cannot take over from its successor.
+- Entries carry the primary's monotonic clock, so a follower on the same
+  host measures replication lag directly.
+- Postings made by idempotent requests carry the request id, and refused
+  requests get an entry of their own, so the follower rebuilds the
+  primary's request log and can answer status queries once promoted.
+- Account openings and closures are journaled too, ahead of any posting
+  to the account and after its last one. An opening carries the balance,
+  currency and owner, and the follower creates the owner if it has none
+  by that id. An entry the replica cannot apply means it has drifted from
+  the primary: the follower stops there, reports itself diverged, and
+  refuses to reconnect or be promoted until it is rebuilt.
+
+Frame: 2-byte length, then seq (8), term (8), kind (1), type (1), amount
+bits (8), monotonic ns (8), and the account number and request id as
+LLVARs. An opening adds the owner id (4) and the currency, owner name and
+PIN as LLVARs; its amount is the opening balance.
+*/
+struct JournalEntry {
+    static const size_t MAX_REQUEST_ID = 255;
+    static const size_t MAX_CURRENCY = 8;
+    static const size_t MAX_OWNER_NAME = 64;
+    static const size_t MAX_FRAME = 2 + 8 + 8 + 1 + 1 + 8 + 8 + 1 + AtmMessage::MAX_ACCOUNT + 1 + MAX_REQUEST_ID +
+                                    4 + 1 + MAX_CURRENCY + 1 + MAX_OWNER_NAME + 1 + AtmMessage::MAX_PIN;
+
+    enum Kind : uint8_t { POSTING, REJECTED_REQUEST, ACCOUNT_OPENED, ACCOUNT_CLOSED };
+
+    uint64_t seq = 0;
+    uint64_t term = 0; // Fencing term of the primary that numbered it
+    Kind kind = POSTING;
+    TransactionType type = TransactionType::DEPOSIT;
+    double amount = 0;
+    int64_t monotonicNs = 0;
+    string_view account;   // Empty for a refused request
+    string_view requestId; // Empty unless posted by an idempotent request
+    uint32_t ownerId = 0;  // The rest only for ACCOUNT_OPENED
+    string_view currency;
+    string_view ownerName;
+    string_view ownerPin;
+};
+
+inline int64_t monotonicNanos() {
+    return chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// Returns the frame size, or 0 if a variable-length field is too long
+inline size_t encodeJournalEntry(const JournalEntry& e, uint8_t* buf) {
+    uint8_t* p = buf + 2;
+    const uint8_t* end = buf + JournalEntry::MAX_FRAME;
+    uint64_t bits;
+    memcpy(&bits, &e.amount, sizeof bits);
+    wire::put(p, e.seq, 8);
+    wire::put(p, e.term, 8);
+    wire::put(p, (uint8_t)e.kind, 1);
+    wire::put(p, (uint8_t)e.type, 1);
+    wire::put(p, bits, 8);
+    wire::put(p, (uint64_t)e.monotonicNs, 8);
+    if (!wire::putVar(p, end, e.account, 1, AtmMessage::MAX_ACCOUNT) ||
+        !wire::putVar(p, end, e.requestId, 1, JournalEntry::MAX_REQUEST_ID))
+        return 0;
+    if (e.kind == JournalEntry::ACCOUNT_OPENED) {
+        wire::put(p, e.ownerId, 4);
+        if (!wire::putVar(p, end, e.currency, 1, JournalEntry::MAX_CURRENCY) ||
+            !wire::putVar(p, end, e.ownerName, 1, JournalEntry::MAX_OWNER_NAME) ||
+            !wire::putVar(p, end, e.ownerPin, 1, AtmMessage::MAX_PIN))
+            return 0;
+    }
+    uint8_t* len = buf;
+    wire::put(len, p - buf - 2, 2);
+    return p - buf;
+}
+
+// Decodes a frame body (without its length prefix); views point into `buf`
+inline bool decodeJournalEntry(const uint8_t* buf, size_t len, JournalEntry& out) {
+    const uint8_t* p = buf;
+    const uint8_t* end = buf + len;
+    if (len < 36) return false;
+    out.seq = wire::get(p, 8);
+    out.term = wire::get(p, 8);
+    out.kind = (JournalEntry::Kind)wire::get(p, 1);
+    out.type = (TransactionType)wire::get(p, 1);
+    uint64_t bits = wire::get(p, 8);
+    memcpy(&out.amount, &bits, sizeof bits);
+    out.monotonicNs = (int64_t)wire::get(p, 8);
+    if (out.kind > JournalEntry::ACCOUNT_CLOSED || !wire::getVar(p, end, out.account, 1, AtmMessage::MAX_ACCOUNT) ||
+        !wire::getVar(p, end, out.requestId, 1, JournalEntry::MAX_REQUEST_ID))
+        return false;
+    if (out.kind == JournalEntry::ACCOUNT_OPENED) {
+        if (end - p < 4) return false;
+        out.ownerId = (uint32_t)wire::get(p, 4);
+        if (!wire::getVar(p, end, out.currency, 1, JournalEntry::MAX_CURRENCY) ||
+            !wire::getVar(p, end, out.ownerName, 1, JournalEntry::MAX_OWNER_NAME) ||
+            !wire::getVar(p, end, out.ownerPin, 1, AtmMessage::MAX_PIN))
+            return false;
+    }
+    return p == end;
+}
+
+namespace net {
+inline bool writeAll(int fd, const void* data, size_t len) {
+    const char* p = (const char*)data;
+    while (len > 0) {
+        ssize_t n = send(fd, p, len, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return false;
+        p += n;
+        len -= n;
+    }
+    return true;
+}
+
+inline bool readAll(int fd, void* data, size_t len) {
+    char* p = (char*)data;
+    while (len > 0) {
+        ssize_t n = recv(fd, p, len, 0);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return false;
+        p += n;
+        len -= n;
+    }
+    return true;
+}
+
+// Returns a listening socket bound to `path`, or -1
+inline int listenUnix(const string& path) {
+    sockaddr_un addr{};
+    if (path.size() >= sizeof(addr.sun_path)) return -1;
+    addr.sun_family = AF_UNIX;
+    memcpy(addr.sun_path, path.c_str(), path.size() + 1);
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) return -1;
+    unlink(path.c_str());
+    if (bind(fd, (sockaddr*)&addr, sizeof addr) != 0 || listen(fd, 16) != 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+inline int connectUnix(const string& path) {
+    sockaddr_un addr{};
+    if (path.size() >= sizeof(addr.sun_path)) return -1;
+    addr.sun_family = AF_UNIX;
+    memcpy(addr.sun_path, path.c_str(), path.size() + 1);
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) return -1;
+    if (connect(fd, (sockaddr*)&addr, sizeof addr) != 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+} // namespace net
+
+class JournalShipper : public IPostingObserver {
+private:
+    // Frames are appended to fixed-size chunks that never move, so the
+    // sender writes a chunk's filled prefix without holding mtx
+    struct Chunk {
+        static const size_t CAPACITY = 1 << 16;
+
+        uint64_t firstSeq;
+        unique_ptr<uint8_t[]> bytes{new uint8_t[CAPACITY]};
+        size_t used = 0;
+        vector<uint32_t> offsets; // offsets[seq - firstSeq] = start of that frame
+    };
+
+    struct Follower {
+        int fd;
+        uint64_t sentSeq; // Last entry written to fd
+    };
+
+    string path;
+    uint64_t term;      // Fencing term of the primary this journal belongs to
+    uint64_t startSeq;  // Entry numbering continued after, and its term
+    uint64_t startTerm;
+    size_t maxRetained; // Bytes of journal kept for slow and late followers
+    int listenFd = -1;
+    mutex mtx;
+    condition_variable cv;
+    deque<shared_ptr<Chunk>> chunks;
+    size_t retained = 0;
+    uint64_t baseSeq; // Sequence of the entry before the first one held
+    uint64_t headSeq; // Sequence of the last entry appended
+    vector<Follower> followers;
+    bool stopping = false;
+    thread acceptThread;
+    thread senderThread;
+
+    void acceptLoop() {
+        while (true) {
+            int fd = accept(listenFd, nullptr, nullptr);
+            if (fd < 0) {
+                if (errno == EINTR) continue;
+                return; // Listening socket shut down
+            }
+            uint8_t raw[16];
+            if (!net::readAll(fd, raw, sizeof raw)) {
+                close(fd);
+                continue;
+            }
+            const uint8_t* p = raw;
+            uint64_t applied = wire::get(p, 8);
+            uint64_t appliedTerm = wire::get(p, 8);
+            bool accepted;
+            {
+                lock_guard<mutex> lock(mtx);
+                // Entries it lacks are no longer held, or it holds ones we never numbered
+                accepted = applied >= baseSeq && applied <= headSeq &&
+                           appliedTerm == (applied == startSeq ? startTerm : term);
+            }
+            uint8_t reply[9];
+            uint8_t* q = reply;
+            wire::put(q, term, 8);
+            wire::put(q, accepted ? 1 : 0, 1);
+            if (!net::writeAll(fd, reply, sizeof reply) || !accepted) {
+                close(fd);
+                continue;
+            }
+            lock_guard<mutex> lock(mtx);
+            followers.push_back({fd, applied});
+            cv.notify_one();
+        }
+    }
+
+    void append(JournalEntry& e) {
+        uint8_t frame[JournalEntry::MAX_FRAME];
+        e.term = term;
+        e.monotonicNs = monotonicNanos();
+        lock_guard<mutex> lock(mtx);
+        e.seq = headSeq + 1;
+        size_t len = encodeJournalEntry(e, frame);
+        if (len == 0) return; // Account number or request id too long to ship
+        if (chunks.empty() || chunks.back()->used + len > Chunk::CAPACITY) {
+            chunks.push_back(make_shared<Chunk>());
+            chunks.back()->firstSeq = e.seq;
+            retained += Chunk::CAPACITY;
+            // Followers still needing a dropped chunk are cut off by the sender
+            while (retained > maxRetained && chunks.size() > 1) {
+                chunks.pop_front();
+                baseSeq = chunks.front()->firstSeq - 1;
+                retained -= Chunk::CAPACITY;
+            }
+        }
+        Chunk& c = *chunks.back();
+        c.offsets.push_back(c.used);
+        memcpy(c.bytes.get() + c.used, frame, len);
+        c.used += len;
+        headSeq = e.seq;
+        cv.notify_one();
+    }
+
+    // The chunk holding entry `seq`, which must be held
+    const shared_ptr<Chunk>& chunkFor(uint64_t seq) const {
+        auto it = upper_bound(chunks.begin(), chunks.end(), seq,
+                              [](uint64_t s, const shared_ptr<Chunk>& c) { return s < c->firstSeq; });
+        return *prev(it);
+    }
+
+    bool behind() const {
+        for (const auto& f : followers) {
+            if (f.sentSeq < headSeq) return true;
+        }
+        return false;
+    }
+
+    // Writes each follower's backlog a chunk at a time with the lock released
+    void sendLoop() {
+        unique_lock<mutex> lock(mtx);
+        while (true) {
+            cv.wait(lock, [&] { return stopping || behind(); });
+            if (stopping) return;
+            for (size_t i = 0; i < followers.size();) {
+                Follower& f = followers[i];
+                if (f.sentSeq == headSeq) {
+                    i++;
+                    continue;
+                }
+                if (f.sentSeq < baseSeq) { // Fell further behind than the journal holds
+                    close(f.fd);
+                    followers.erase(followers.begin() + i);
+                    continue;
+                }
+                shared_ptr<Chunk> chunk = chunkFor(f.sentSeq + 1);
+                const uint8_t* from = chunk->bytes.get() + chunk->offsets[f.sentSeq + 1 - chunk->firstSeq];
+                const uint8_t* to = chunk->bytes.get() + chunk->used;
+                uint64_t upTo = chunk->firstSeq + chunk->offsets.size() - 1;
+                int fd = f.fd;
+                lock.unlock();
+                bool ok = net::writeAll(fd, from, to - from);
+                lock.lock();
+                if (ok) {
+                    followers[i++].sentSeq = upTo;
+                } else {
+                    close(fd);
+                    followers.erase(followers.begin() + i);
+                }
+            }
+        }
+    }
+
+public:
+    // `primaryTerm` is the fencing term this primary holds. Numbering
+    // continues after `lastSeq` from term `lastTerm`, e.g. the last entry a
+    // promoted follower applied. About `maxRetainedBytes` of journal is kept.
+    JournalShipper(const string& socketPath, uint64_t primaryTerm, uint64_t lastSeq = 0, uint64_t lastTerm = 0,
+                   size_t maxRetainedBytes = 64 << 20)
+        : path(socketPath), term(primaryTerm), startSeq(lastSeq), startTerm(lastTerm),
+          maxRetained(maxRetainedBytes), baseSeq(lastSeq), headSeq(lastSeq) {
+        listenFd = net::listenUnix(path);
+        if (listenFd < 0) return;
+        acceptThread = thread(&JournalShipper::acceptLoop, this);
+        senderThread = thread(&JournalShipper::sendLoop, this);
+    }
+
+    JournalShipper(const JournalShipper&) = delete;
+    JournalShipper& operator=(const JournalShipper&) = delete;
+
+    ~JournalShipper() {
+        if (listenFd < 0) return;
+        shutdown(listenFd, SHUT_RDWR);
+        acceptThread.join();
+        {
+            lock_guard<mutex> lock(mtx);
+            stopping = true;
+        }
+        cv.notify_one();
+        senderThread.join();
+        for (const auto& f : followers) close(f.fd);
+        close(listenFd);
+        unlink(path.c_str());
+    }
+
+    bool isListening() const { return listenFd >= 0; }
+
+    void onPosting(const Posting& posting) override {
+        JournalEntry e;
+        e.type = posting.type;
+        e.amount = posting.amount;
+        e.account = posting.accountNumber;
+        e.requestId = posting.requestId;
+        append(e);
+    }
+
+    void onRejectedRequest(string_view requestId) override {
+        JournalEntry e;
+        e.kind = JournalEntry::REJECTED_REQUEST;
+        e.requestId = requestId;
+        append(e);
+    }
+
+    void onAccountOpened(const AccountOpening& opening) override {
+        JournalEntry e;
+        e.kind = JournalEntry::ACCOUNT_OPENED;
+        e.amount = opening.balance;
+        e.account = opening.accountNumber;
+        e.ownerId = opening.ownerId;
+        e.currency = opening.currency;
+        e.ownerName = opening.ownerName;
+        e.ownerPin = opening.ownerPin;
+        append(e);
+    }
+
+    void onAccountClosed(string_view accountNumber) override {
+        JournalEntry e;
+        e.kind = JournalEntry::ACCOUNT_CLOSED;
+        e.account = accountNumber;
+        append(e);
+    }
+
+    uint64_t lastSeq() {
+        lock_guard<mutex> lock(mtx);
+        return headSeq;
+    }
+
+    // Followers behind this must be rebuilt from the primary
+    uint64_t oldestHeldSeq() {
+        lock_guard<mutex> lock(mtx);
+        return baseSeq;
+    }
+
+    size_t followerCount() {
+        lock_guard<mutex> lock(mtx);
+        return followers.size();
+    }
+};
+
+struct ReplicationStats {
+    uint64_t appliedSeq = 0;
+    uint64_t appliedTerm = 0; // Term of the entry at appliedSeq
+    uint64_t applied = 0;
+    uint64_t failed = 0;      // Entries the replica could not apply; one is enough to diverge
+    double totalLagUs = 0;    // Primary posting -> follower apply
+    double maxLagUs = 0;
+    double averageLagUs() const { return applied ? totalLagUs / applied : 0; }
+};
+
+class FollowerBankService : public IBankService {
+private:
+    BankService* replica;
+    int fd = -1;
+    uint64_t followedTerm = 0; // Term of the primary last connected to
+    atomic<bool> connected{false};
+    atomic<bool> promoted{false};
+    atomic<bool> diverged{false}; // An entry failed to apply; the replica must be rebuilt
+    thread receiverThread;
+    mutable mutex statsMtx;
+    ReplicationStats stats;
+
+    // Applies one entry; the caller folds the result into `batch`. False
+    // if the replica no longer matches the primary.
+    bool apply(const JournalEntry& e, ReplicationStats& batch) {
+        string accNum(e.account);
+        string requestId(e.requestId);
+        bool ok = true;
+        if (e.kind == JournalEntry::REJECTED_REQUEST) {
+            replica->recordRejectedRequest(requestId);
+        } else if (e.kind == JournalEntry::ACCOUNT_OPENED) {
+            Account* acc = new Account(accNum, e.amount, string(e.currency));
+            ok = replica->openReplicatedAccount(e.ownerId, string(e.ownerName), string(e.ownerPin), acc);
+            if (!ok) Account::releaseRef(acc);
+        } else if (e.kind == JournalEntry::ACCOUNT_CLOSED) {
+            ok = replica->releaseAccounts({accNum}) == 1;
+        } else if (requestId.empty()) {
+            ok = e.type == TransactionType::DEPOSIT ? replica->deposit(accNum, e.amount)
+                                                    : replica->withdraw(accNum, e.amount);
+        } else {
+            AccountHandle h = replica->openAccountHandle(accNum);
+            ok = e.type == TransactionType::DEPOSIT ? replica->depositIdempotent(requestId, h, e.amount)
+                                                    : replica->withdrawIdempotent(requestId, h, e.amount, "");
+        }
+        double lagUs = (monotonicNanos() - e.monotonicNs) / 1000.0;
+        if (!ok) { // Not counted as applied: a rebuilt replica resumes after the last good entry
+            batch.failed++;
+            return false;
+        }
+        batch.appliedSeq = e.seq;
+        batch.appliedTerm = e.term;
+        batch.applied++;
+        batch.totalLagUs += lagUs;
+        batch.maxLagUs = max(batch.maxLagUs, lagUs);
+        return true;
+    }
+
+    // Reads whatever has arrived and applies every complete frame in it
+    void receiveLoop() {
+        vector<uint8_t> buf(1 << 16);
+        size_t filled = 0;
+        uint64_t next = appliedSeq() + 1;
+        while (true) {
+            ssize_t n = recv(fd, buf.data() + filled, buf.size() - filled, 0);
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) break;
+            filled += n;
+
+            ReplicationStats batch;
+            size_t pos = 0;
+            bool corrupt = false;
+            while (filled - pos >= 2) {
+                const uint8_t* p = buf.data() + pos;
+                size_t bodyLen = wire::get(p, 2);
+                if (bodyLen > JournalEntry::MAX_FRAME) { corrupt = true; break; }
+                if (filled - pos - 2 < bodyLen) break;
+                JournalEntry e;
+                if (!decodeJournalEntry(p, bodyLen, e)) { corrupt = true; break; }
+                if (e.term != followedTerm) { corrupt = true; break; }
+                if (e.seq == next) { // Anything else is a replay
+                    if (!apply(e, batch)) {
+                        diverged.store(true, memory_order_release);
+                        corrupt = true;
+                        break;
+                    }
+                    next++;
+                }
+                pos += 2 + bodyLen;
+            }
+            memmove(buf.data(), buf.data() + pos, filled - pos);
+            filled -= pos;
+            if (batch.applied > 0 || batch.failed > 0) {
+                lock_guard<mutex> lock(statsMtx);
+                if (batch.applied > 0) {
+                    stats.appliedSeq = batch.appliedSeq;
+                    stats.appliedTerm = batch.appliedTerm;
+                }
+                stats.applied += batch.applied;
+                stats.failed += batch.failed;
+                stats.totalLagUs += batch.totalLagUs;
+                stats.maxLagUs = max(stats.maxLagUs, batch.maxLagUs);
+            }
+            if (corrupt) break;
+        }
+        connected.store(false, memory_order_release);
+    }
+
+public:
+    // `replica` must hold the same accounts the primary started from
+    explicit FollowerBankService(BankService* replicaBank) : replica(replicaBank) {}
+
+    FollowerBankService(const FollowerBankService&) = delete;
+    FollowerBankService& operator=(const FollowerBankService&) = delete;
+
+    ~FollowerBankService() { disconnect(); }
+
+    // Subscribes to the primary's journal from the last applied entry on
+    bool connectTo(const string& socketPath) {
+        disconnect();
+        if (isPrimary() || hasDiverged()) return false;
+        fd = net::connectUnix(socketPath);
+        if (fd < 0) return false;
+        ReplicationStats applied = getStats();
+        uint8_t raw[16];
+        uint8_t* p = raw;
+        wire::put(p, applied.appliedSeq, 8);
+        wire::put(p, applied.appliedTerm, 8);
+        uint8_t reply[9];
+        const uint8_t* q = reply;
+        // Refused when this replica has diverged from the primary's journal
+        if (!net::writeAll(fd, raw, sizeof raw) || !net::readAll(fd, reply, sizeof reply) || reply[8] != 1) {
+            close(fd);
+            fd = -1;
+            return false;
+        }
+        followedTerm = wire::get(q, 8);
+        connected.store(true, memory_order_release);
+        receiverThread = thread(&FollowerBankService::receiveLoop, this);
+        return true;
+    }
+
+    void disconnect() {
+        if (fd < 0) return;
+        shutdown(fd, SHUT_RDWR);
+        receiverThread.join();
+        close(fd);
+        fd = -1;
+    }
+
+    bool isConnected() const { return connected.load(memory_order_acquire); }
+
+    // The replica failed to apply an entry and no longer matches the primary
+    bool hasDiverged() const { return diverged.load(memory_order_acquire); }
+
+    // Stops following and takes over as primary at `endpoint` under the
+    // term after the one it followed. Fails if that term has moved on,
+    // e.g. because another follower was promoted first.
+    bool promote(FencingToken& fence, const string& endpoint, uint64_t& newTerm) {
+        disconnect();
+        if (hasDiverged() || !fence.claim(followedTerm, endpoint, newTerm)) return false;
+        promoted.store(true, memory_order_release);
+        return true;
+    }
+
+    bool isPrimary() const { return promoted.load(memory_order_acquire); }
+
+    uint64_t appliedSeq() const {
+        lock_guard<mutex> lock(statsMtx);
+        return stats.appliedSeq;
+    }
+
+    uint64_t appliedTerm() const {
+        lock_guard<mutex> lock(statsMtx);
+        return stats.appliedTerm;
+    }
+
+    ReplicationStats getStats() const {
+        lock_guard<mutex> lock(statsMtx);
+        return stats;
+    }
+
+    // Read-only until promoted: postings go to the primary
+    bool deposit(const string& accNum, double amount) override {
+        return isPrimary() && replica->deposit(accNum, amount);
+    }
+    bool withdraw(const string& accNum, double amount) override {
+        return isPrimary() && replica->withdraw(accNum, amount);
+    }
+    bool withdrawInCurrency(const string& accNum, double amount, const string& currency) override {
+        return isPrimary() && replica->withdrawInCurrency(accNum, amount, currency);
+    }
+    bool depositIdempotent(const string& requestId, const AccountHandle& h, double amount) override {
+        return isPrimary() && replica->depositIdempotent(requestId, h, amount);
+    }
+    bool withdrawIdempotent(const string& requestId, const AccountHandle& h, double amount,
+                            const string& currency) override {
+        return isPrimary() && replica->withdrawIdempotent(requestId, h, amount, currency);
+    }
+
+    // The primary's request log, as far as it has been replicated
+    RequestStatus getRequestStatus(const string& requestId) override { return replica->getRequestStatus(requestId); }
+    bool keepsRequestLog() override { return true; }
+
+    double getBalance(const string& accNum) override { return replica->getBalance(accNum); }
+    string getCurrency(const string& accNum) override { return replica->getCurrency(accNum); }
+    void showTransactions(const string& accNum) override { replica->showTransactions(accNum); }
+    vector<Transaction> getTransactions(const string& accNum) override { return replica->getTransactions(accNum); }
+    User* getUserByAccount(const string& accNum) override { return replica->getUserByAccount(accNum); }
+    Account* getAccount(const string& accNum) override { return replica->getAccount(accNum); }
+};
+
+// ---------------- Bank Server ----------------
+/*
+Serves an IBankService to remote ATMs over a Unix socket.
+- Each frame is a 2-byte length followed by one encoded AtmMessage;
+  responses echo the request's STAN. Amounts travel in cents.
+- One thread per connection: a server has a handful of ATM front ends,
+  not thousands of customers. A worker closes its connection when it
+  ends and is joined at the next accept.
+- With a fencing token, the server answers RESPONSE_NOT_PRIMARY to
+  every request once its term is no longer current. Postings check the
+  term again under the token's lock (see Fencing).
+- A posting with a request id goes through the idempotent variants, and
+  STATUS_REQUEST reports the outcome of one. Postings of zero or a
+  negative amount are declined.
+*/
+class BankServer {
+private:
+    static const size_t MAX_FRAME = UINT16_MAX;
+
+    IBankService* bank;
+    FencingToken* fence; // Null: never fenced
+    uint64_t term;
+    string path;
+    int listenFd = -1;
+    struct Client {
+        int fd;       // -1 once the worker has closed it
+        thread worker;
+    };
+    mutex mtx; // Guards clients and finished
+    unordered_map<uint64_t, Client> clients;
+    vector<uint64_t> finished; // Workers that have returned but are not joined yet
+    uint64_t nextClient = 0;
+    thread acceptThread;
+
+    bool fenced() const { return fence && fence->term() != term; }
+
+    // Runs a posting while this server is still primary; false if deposed
+    template <typename Fn>
+    bool postWhilePrimary(bool& ok, Fn post) {
+        if (!fence) {
+            ok = post();
+            return true;
+        }
+        return fence->whileCurrent(term, [&] { ok = post(); });
+    }
+
+    // `history` backs resp.history or resp.currency and must outlive the encode
+    void handle(const AtmMessage& req, AtmMessage& resp, string& history) {
+        resp.stan = req.stan;
+        resp.set(FIELD_STAN);
+        resp.set(FIELD_RESPONSE_CODE);
+        resp.mti = (AtmMti)((uint16_t)req.mti + 0x10);
+        if (fenced()) {
+            resp.responseCode = RESPONSE_NOT_PRIMARY;
+            return;
+        }
+        string accNum(req.account);
+        double amount = req.amountMinor / 100.0;
+        switch (req.mti) {
+            case AtmMti::LOGIN_REQUEST:
+                resp.responseCode = bank->authenticate(accNum, string(req.pin)) ? RESPONSE_APPROVED : RESPONSE_DECLINED;
+                break;
+            case AtmMti::BALANCE_REQUEST: {
+                double balance = bank->getBalance(accNum);
+                resp.responseCode = balance < 0 ? RESPONSE_UNKNOWN_ACCOUNT : RESPONSE_APPROVED;
+                resp.amountMinor = llround(balance * 100);
+                resp.set(FIELD_AMOUNT);
+                history = bank->getCurrency(accNum);
+                if (history.size() == 3) {
+                    resp.currency = history;
+                    resp.set(FIELD_CURRENCY);
+                }
+                break;
+            }
+            case AtmMti::DEPOSIT_REQUEST: {
+                bool ok = false;
+                bool primary = req.amountMinor <= 0 || postWhilePrimary(ok, [&] {
+                    return req.has(FIELD_REQUEST_ID)
+                               ? bank->depositIdempotent(string(req.requestId), bank->openAccountHandle(accNum), amount)
+                               : bank->deposit(accNum, amount);
+                });
+                resp.responseCode = !primary ? RESPONSE_NOT_PRIMARY : ok ? RESPONSE_APPROVED : RESPONSE_DECLINED;
+                break;
+            }
+            case AtmMti::WITHDRAW_REQUEST: {
+                string currency = req.has(FIELD_CURRENCY) ? string(req.currency) : "";
+                bool ok = false;
+                bool primary = req.amountMinor <= 0 || postWhilePrimary(ok, [&] {
+                    return req.has(FIELD_REQUEST_ID)
+                               ? bank->withdrawIdempotent(string(req.requestId), bank->openAccountHandle(accNum),
+                                                          amount, currency)
+                           : currency.empty() ? bank->withdraw(accNum, amount)
+                                              : bank->withdrawInCurrency(accNum, amount, currency);
+                });
+                resp.responseCode = !primary ? RESPONSE_NOT_PRIMARY : ok ? RESPONSE_APPROVED : RESPONSE_DECLINED;
+                break;
+            }
+            case AtmMti::STATUS_REQUEST: // Declined when the bank keeps no request log
+                resp.amountMinor = (int64_t)bank->getRequestStatus(string(req.requestId));
+                resp.set(FIELD_AMOUNT);
+                resp.responseCode = bank->keepsRequestLog() ? RESPONSE_APPROVED : RESPONSE_DECLINED;
+                break;
+            case AtmMti::HISTORY_REQUEST: {
+                vector<Transaction> transactions = bank->getTransactions(accNum);
+                size_t fit = (MAX_FRAME - 64) / AtmMessage::HISTORY_ENTRY_SIZE; // The latest that fit
+                size_t first = transactions.size() > fit ? transactions.size() - fit : 0;
+                history.resize((transactions.size() - first) * AtmMessage::HISTORY_ENTRY_SIZE);
+                uint8_t* p = (uint8_t*)history.data();
+                for (size_t i = first; i < transactions.size(); i++, p += AtmMessage::HISTORY_ENTRY_SIZE)
+                    encodeHistoryEntry(p, transactions[i].getType(), llround(transactions[i].getAmount() * 100));
+                resp.history = history;
+                resp.set(FIELD_HISTORY);
+                resp.responseCode = RESPONSE_APPROVED;
+                break;
+            }
+            default:
+                resp.responseCode = RESPONSE_DECLINED;
+        }
+    }
+
+    void serve(uint64_t id, int fd) {
+        vector<uint8_t> in(MAX_FRAME), out(2 + MAX_FRAME);
+        string history;
+        while (true) {
+            uint8_t len[2];
+            if (!net::readAll(fd, len, 2)) break;
+            const uint8_t* p = len;
+            size_t reqLen = wire::get(p, 2);
+            AtmMessage req, resp;
+            if (!net::readAll(fd, in.data(), reqLen) || !decodeMessage(in.data(), reqLen, req)) break;
+            handle(req, resp, history);
+            size_t respLen = encodeMessage(resp, out.data() + 2, MAX_FRAME);
+            uint8_t* q = out.data();
+            wire::put(q, respLen, 2);
+            if (respLen == 0 || !net::writeAll(fd, out.data(), 2 + respLen)) break;
+        }
+        lock_guard<mutex> lock(mtx);
+        close(fd);
+        clients[id].fd = -1;
+        finished.push_back(id);
+    }
+
+    // Caller holds mtx
+    void reapFinished() {
+        for (uint64_t id : finished) {
+            clients[id].worker.join(); // Already past its last use of mtx
+            clients.erase(id);
+        }
+        finished.clear();
+    }
+
+    void acceptLoop() {
+        while (true) {
+            int fd = accept(listenFd, nullptr, nullptr);
+            if (fd < 0) {
+                if (errno == EINTR) continue;
+                return; // Listening socket shut down
+            }
+            lock_guard<mutex> lock(mtx);
+            reapFinished();
+            uint64_t id = nextClient++;
+            Client& client = clients[id];
+            client.fd = fd;
+            client.worker = thread(&BankServer::serve, this, id, fd);
+        }
+    }
+
+public:
+    // Listens on `socketPath`. With a fence, serves only while `serverTerm`
+    // is the current term.
+    BankServer(IBankService* service, const string& socketPath, FencingToken* fencing = nullptr,
+               uint64_t serverTerm = 0)
+        : bank(service), fence(fencing), term(serverTerm), path(socketPath) {
+        listenFd = net::listenUnix(path);
+        if (listenFd >= 0) acceptThread = thread(&BankServer::acceptLoop, this);
+    }
+
+    BankServer(const BankServer&) = delete;
+    BankServer& operator=(const BankServer&) = delete;
+
+    ~BankServer() {
+        if (listenFd < 0) return;
+        shutdown(listenFd, SHUT_RDWR);
+        acceptThread.join();
+        {
+            lock_guard<mutex> lock(mtx);
+            for (auto& [id, client] : clients) {
+                if (client.fd >= 0) shutdown(client.fd, SHUT_RDWR);
+            }
+        }
+        for (auto& [id, client] : clients) client.worker.join(); // No more inserts once accepting stopped
+        close(listenFd);
+        unlink(path.c_str());
+    }
+
+    bool isListening() const { return listenFd >= 0; }
+};
+
+// ---------------- Remote BankService ----------------
+/*
+The client side of BankServer.
+- `locate` names the server to use, e.g. the fencing token's current
+  primary. After a broken connection or a NOT_PRIMARY reply the client
+  asks again and reconnects, for up to `failoverTimeout`.
+- Reads are retried after any failure. A posting is retried only while
+  it certainly has not been applied: the connection or send failed, or
+  the server refused it. A posting whose reply was lost fails; the
+  customer sees a declined transaction instead of a double posting.
+  Idempotent postings carry their request id and are retried like reads.
+- PINs are checked by the server. getUserByAccount returns a local
+  stand-in User whose only account is the one it was looked up by.
+- Calls on one instance are serialized over its single connection.
+*/
+class RemoteBankService : public IBankService {
+private:
+    static const size_t MAX_FRAME = UINT16_MAX;
+
+    function<string()> locate;
+    chrono::milliseconds failoverTimeout;
+    mutex mtx; // Guards everything below
+    int fd = -1;
+    uint32_t nextStan = 1;
+    vector<uint8_t> out = vector<uint8_t>(2 + MAX_FRAME);
+    vector<uint8_t> in = vector<uint8_t>(MAX_FRAME);
+    unordered_map<string, unique_ptr<User>> standIns; // By account number
+
+    void dropConnection() {
+        if (fd >= 0) close(fd);
+        fd = -1;
+    }
+
+    // Caller holds mtx. Views in `resp` point into `in`.
+    bool call(AtmMessage& req, AtmMessage& resp, bool posting) {
+        auto deadline = chrono::steady_clock::now() + failoverTimeout;
+        req.stan = nextStan++;
+        req.set(FIELD_STAN);
+        size_t len = encodeMessage(req, out.data() + 2, MAX_FRAME);
+        if (len == 0) return false;
+        uint8_t* p = out.data();
+        wire::put(p, len, 2);
+        while (true) {
+            if (fd < 0) fd = net::connectUnix(locate());
+            if (fd >= 0) {
+                if (!net::writeAll(fd, out.data(), 2 + len)) {
+                    dropConnection(); // Never reached the server whole
+                } else {
+                    uint8_t lenBytes[2];
+                    const uint8_t* q = lenBytes;
+                    bool replied = net::readAll(fd, lenBytes, 2);
+                    size_t respLen = replied ? wire::get(q, 2) : 0;
+                    replied = replied && net::readAll(fd, in.data(), respLen) &&
+                              decodeMessage(in.data(), respLen, resp) && resp.stan == req.stan;
+                    if (replied && resp.responseCode != RESPONSE_NOT_PRIMARY) return true;
+                    dropConnection();
+                    if (!replied && posting) return false; // May have been applied
+                }
+            }
+            if (chrono::steady_clock::now() >= deadline) return false;
+            this_thread::sleep_for(chrono::milliseconds(2));
+        }
+    }
+
+    bool post(AtmMti mti, const string& accNum, double amount, const string& currency,
+              const string& requestId = "") {
+        AtmMessage req, resp;
+        req.mti = mti;
+        req.account = accNum;
+        req.amountMinor = llround(amount * 100);
+        req.set(FIELD_ACCOUNT);
+        req.set(FIELD_AMOUNT);
+        if (!currency.empty()) {
+            req.currency = currency;
+            req.set(FIELD_CURRENCY);
+        }
+        if (!requestId.empty()) {
+            req.requestId = requestId;
+            req.set(FIELD_REQUEST_ID);
+        }
+        lock_guard<mutex> lock(mtx);
+        return call(req, resp, requestId.empty()) && resp.responseCode == RESPONSE_APPROVED;
+    }
+
+public:
+    explicit RemoteBankService(function<string()> locator,
+                               chrono::milliseconds timeout = chrono::milliseconds(2000))
+        : locate(move(locator)), failoverTimeout(timeout) {}
+
+    RemoteBankService(const RemoteBankService&) = delete;
+    RemoteBankService& operator=(const RemoteBankService&) = delete;
+
+    ~RemoteBankService() { dropConnection(); }
+
+    bool deposit(const string& accNum, double amount) override {
+        return post(AtmMti::DEPOSIT_REQUEST, accNum, amount, "");
+    }
+
+    bool withdraw(const string& accNum, double amount) override {
+        return post(AtmMti::WITHDRAW_REQUEST, accNum, amount, "");
+    }
+
+    bool withdrawInCurrency(const string& accNum, double amount, const string& currency) override {
+        return currency.size() == 3 && post(AtmMti::WITHDRAW_REQUEST, accNum, amount, currency);
+    }
+
+    bool depositIdempotent(const string& requestId, const AccountHandle& h, double amount) override {
+        return post(AtmMti::DEPOSIT_REQUEST, h.accountNumber(), amount, "", requestId);
+    }
+
+    bool withdrawIdempotent(const string& requestId, const AccountHandle& h, double amount,
+                            const string& currency) override {
+        if (!currency.empty() && currency.size() != 3) return false;
+        return post(AtmMti::WITHDRAW_REQUEST, h.accountNumber(), amount, currency, requestId);
+    }
+
+    RequestStatus getRequestStatus(const string& requestId) override {
+        AtmMessage req, resp;
+        req.mti = AtmMti::STATUS_REQUEST;
+        req.requestId = requestId;
+        req.set(FIELD_REQUEST_ID);
+        lock_guard<mutex> lock(mtx);
+        if (!call(req, resp, false) || resp.responseCode != RESPONSE_APPROVED) return RequestStatus::UNKNOWN;
+        return (RequestStatus)resp.amountMinor;
+    }
+
+    // Asks the server, which declines status requests without a log
+    bool keepsRequestLog() override {
+        AtmMessage req, resp;
+        req.mti = AtmMti::STATUS_REQUEST;
+        req.requestId = "";
+        req.set(FIELD_REQUEST_ID);
+        lock_guard<mutex> lock(mtx);
+        return call(req, resp, false) && resp.responseCode == RESPONSE_APPROVED;
+    }
+
+    double getBalance(const string& accNum) override {
+        AtmMessage req, resp;
+        req.mti = AtmMti::BALANCE_REQUEST;
+        req.account = accNum;
+        req.set(FIELD_ACCOUNT);
+        lock_guard<mutex> lock(mtx);
+        if (!call(req, resp, false) || resp.responseCode != RESPONSE_APPROVED) return -1;
+        return resp.amountMinor / 100.0;
+    }
+
+    // Balance replies carry the account's currency
+    string getCurrency(const string& accNum) override {
+        AtmMessage req, resp;
+        req.mti = AtmMti::BALANCE_REQUEST;
+        req.account = accNum;
+        req.set(FIELD_ACCOUNT);
+        lock_guard<mutex> lock(mtx);
+        if (!call(req, resp, false) || resp.responseCode != RESPONSE_APPROVED || !resp.has(FIELD_CURRENCY)) return "";
+        return string(resp.currency);
+    }
+
+    // Entries carry no timestamp on the wire; they are stamped on arrival
+    vector<Transaction> getTransactions(const string& accNum) override {
+        AtmMessage req, resp;
+        req.mti = AtmMti::HISTORY_REQUEST;
+        req.account = accNum;
+        req.set(FIELD_ACCOUNT);
+        vector<Transaction> transactions;
+        lock_guard<mutex> lock(mtx);
+        if (!call(req, resp, false) || resp.responseCode != RESPONSE_APPROVED) return transactions;
+        forEachHistoryEntry(resp.history, [&](TransactionType type, int64_t amountMinor) {
+            transactions.emplace_back(type, amountMinor / 100.0);
+        });
+        return transactions;
+    }
+
+    void showTransactions(const string& accNum) override {
+        vector<Transaction> transactions = getTransactions(accNum);
+        if (transactions.empty()) {
+            cout << "No transactions yet.\n";
+            return;
+        }
+        cout << "Transaction history for account " << accNum << ":\n";
+        for (const auto& t : transactions) t.show();
+    }
+
+    bool authenticate(const string& accNum, const string& pin) override {
+        AtmMessage req, resp;
+        req.mti = AtmMti::LOGIN_REQUEST;
+        req.account = accNum;
+        req.pin = pin;
+        req.set(FIELD_ACCOUNT);
+        req.set(FIELD_PIN);
+        lock_guard<mutex> lock(mtx);
+        return call(req, resp, false) && resp.responseCode == RESPONSE_APPROVED;
+    }
+
+    User* getUserByAccount(const string& accNum) override {
+        lock_guard<mutex> lock(mtx);
+        auto& user = standIns[accNum];
+        if (!user) user = make_unique<User>(accNum, "");
+        return user.get();
+    }
+
+    Account* getAccount(const string&) override { return nullptr; }
+
+    vector<AccountHandle> openUserAccounts(User* user) override {
+        vector<AccountHandle> handles;
+        lock_guard<mutex> lock(mtx);
+        for (const auto& [accNum, standIn] : standIns) {
+            if (standIn.get() == user) handles.push_back(AccountHandle::unresolved(accNum));
+        }
+        return handles;
+    }
+};
+
+// ---------------- Change Stream ----------------
+/*
+Publishes every applied posting to in-process subscribers (fraud checks,
+notifications, analytics) without ever making the posting path wait.
+- Postings enter a bounded lock-free MPSC ring. A posting that finds it
+  full goes to a spill file instead, and so does every later one until
+  the dispatcher has drained the file. The ring is always drained before
+  the file, so each account's events stay in posting order.
+- One dispatcher thread numbers the events and copies them into a
+  broadcast ring. Each subscriber reads at its own cursor. The dispatcher
+  never overwrites an event that some subscriber has not read yet. A slow
+  subscriber therefore stalls only the dispatcher; the ingest ring then
+  fills and spills to disk. Memory stays at the two ring sizes.
+- The posting path only wakes the dispatcher when it is idle.
+- Account numbers longer than 31 characters are truncated in events.
+*/
+struct ChangeEvent {
+    uint64_t seq = 0;        // Dispatch order, from 1
+    TransactionType type = TransactionType::DEPOSIT;
+    double amount = 0;
+    double balanceAfter = 0;
+    int64_t monotonicNs = 0; // When the posting was applied
+    char accountNumber[32] = {};
+
+    string_view account() const { return accountNumber; }
+};
+
+// Bounded MPSC queue: many pushers, one popper (Vyukov's cell sequences)
+template <typename T>
+class MpscRing {
+private:
+    struct Cell {
+        atomic<size_t> seq;
+        T value;
+    };
+    unique_ptr<Cell[]> cells;
+    size_t mask;
+    alignas(64) atomic<size_t> enqueuePos{0};
+    alignas(64) size_t dequeuePos = 0;
+
+public:
+    // `capacity` is rounded up to a power of two
+    explicit MpscRing(size_t capacity) {
+        size_t n = 2;
+        while (n < capacity) n <<= 1;
+        cells.reset(new Cell[n]);
+        mask = n - 1;
+        for (size_t i = 0; i < n; i++) cells[i].seq.store(i, memory_order_relaxed);
+    }
+
+    bool tryPush(const T& value) {
+        size_t pos = enqueuePos.load(memory_order_relaxed);
+        Cell* cell;
+        while (true) {
+            cell = &cells[pos & mask];
+            intptr_t diff = (intptr_t)cell->seq.load(memory_order_acquire) - (intptr_t)pos;
+            if (diff == 0 && enqueuePos.compare_exchange_weak(pos, pos + 1, memory_order_relaxed)) break;
+            if (diff < 0) return false; // Full
+            if (diff > 0) pos = enqueuePos.load(memory_order_relaxed);
+        }
+        cell->value = value;
+        cell->seq.store(pos + 1, memory_order_release);
+        return true;
+    }
+
+    // Consumer only
+    bool tryPop(T& out) {
+        Cell* cell = &cells[dequeuePos & mask];
+        if (cell->seq.load(memory_order_acquire) != dequeuePos + 1) return false;
+        out = cell->value;
+        cell->seq.store(dequeuePos + mask + 1, memory_order_release);
+        dequeuePos++;
+        return true;
+    }
+};
+
+// Lets several observers share a bank's single observer slot
+class PostingObserverChain : public IPostingObserver {
+private:
+    vector<IPostingObserver*> observers;
+
+public:
+    explicit PostingObserverChain(vector<IPostingObserver*> list) : observers(move(list)) {}
+
+    void onPosting(const Posting& posting) override {
+        for (IPostingObserver* obs : observers) obs->onPosting(posting);
+    }
+
+    void onRejectedRequest(string_view requestId) override {
+        for (IPostingObserver* obs : observers) obs->onRejectedRequest(requestId);
+    }
+
+    void onAccountOpened(const AccountOpening& opening) override {
+        for (IPostingObserver* obs : observers) obs->onAccountOpened(opening);
+    }
+
+    void onAccountClosed(string_view accountNumber) override {
+        for (IPostingObserver* obs : observers) obs->onAccountClosed(accountNumber);
+    }
+};
+
+struct ChangeStreamStats {
+    uint64_t published = 0;
+    uint64_t spilled = 0;      // Events that went through the spill file
+    uint64_t stalls = 0;       // Times the dispatcher waited for a subscriber
+    double maxDispatchLagUs = 0; // Posting -> visible to subscribers
+};
+
+class ChangeStream : public IPostingObserver {
+public:
+    class Subscription {
+    private:
+        friend class ChangeStream;
+        ChangeStream* stream;
+        atomic<uint64_t> cursor; // Events consumed so far
+
+        Subscription(ChangeStream* s, uint64_t start) : stream(s), cursor(start) {}
+
+    public:
+        Subscription(const Subscription&) = delete;
+        Subscription& operator=(const Subscription&) = delete;
+        ~Subscription() { stream->unsubscribe(this); }
+
+        // Appends up to `maxEvents` unread events to `out`; never blocks
+        size_t poll(vector<ChangeEvent>& out, size_t maxEvents = SIZE_MAX) {
+            uint64_t from = cursor.load(memory_order_relaxed);
+            uint64_t to = min(stream->published.load(memory_order_acquire), from + (uint64_t)min<size_t>(maxEvents, UINT32_MAX));
+            for (uint64_t i = from; i < to; i++) out.push_back(stream->slots[i % stream->slots.size()]);
+            if (to == from) return 0;
+            cursor.store(to, memory_order_release);
+            if (stream->dispatcherStalled.load()) {
+                lock_guard<mutex> lock(stream->progressMtx);
+                stream->progressCv.notify_one();
+            }
+            return to - from;
+        }
+
+        // Waits until there is something to poll; false on timeout
+        bool wait(chrono::milliseconds timeout) {
+            auto ready = [&] { return stream->published.load() > cursor.load(memory_order_relaxed) || stream->stopping; };
+            stream->waiters.fetch_add(1);
+            unique_lock<mutex> lock(stream->dataMtx);
+            bool ok = stream->dataCv.wait_for(lock, timeout, ready);
+            stream->waiters.fetch_sub(1);
+            return ok && !stream->stopping;
+        }
+
+        uint64_t position() const { return cursor.load(memory_order_acquire); }
+    };
+
+private:
+    MpscRing<ChangeEvent> ingest;
+    vector<ChangeEvent> slots; // Broadcast ring, written by the dispatcher only
+    atomic<uint64_t> published{0};
+
+    // Spill state (guarded by spillMtx, except the flag)
+    atomic<bool> spilling{false};
+    mutex spillMtx;
+    FILE* spillFile;    // Receives spilled events
+    FILE* drainFile;    // Being read back by the dispatcher
+    atomic<uint64_t> spilled{0};
+
+    mutex subsMtx;
+    vector<Subscription*> subscribers;
+
+    // Dispatcher wake-ups
+    atomic<bool> dispatcherIdle{false};
+    atomic<bool> dispatcherStalled{false};
+    mutex wakeMtx;
+    condition_variable wakeCv;
+    mutex progressMtx;
+    condition_variable progressCv;
+    atomic<uint32_t> waiters{0};
+    mutex dataMtx;
+    condition_variable dataCv;
+    bool stopping = false; // Guarded by wakeMtx and dataMtx
+
+    mutex statsMtx;
+    ChangeStreamStats stats;
+    thread dispatcher;
+
+    void wakeDispatcher() {
+        if (dispatcherIdle.exchange(false)) {
+            lock_guard<mutex> lock(wakeMtx);
+            wakeCv.notify_one();
+        }
+    }
+
+    void unsubscribe(Subscription* sub) {
+        lock_guard<mutex> lock(subsMtx);
+        subscribers.erase(remove(subscribers.begin(), subscribers.end(), sub), subscribers.end());
+        lock_guard<mutex> progress(progressMtx);
+        progressCv.notify_one(); // It may have been the one holding the dispatcher back
+    }
+
+    // `next` is the dispatcher's own position, possibly not published yet
+    uint64_t slowestCursor(uint64_t next) {
+        lock_guard<mutex> lock(subsMtx);
+        uint64_t slowest = next;
+        for (Subscription* sub : subscribers) slowest = min(slowest, sub->cursor.load(memory_order_acquire));
+        return slowest;
+    }
+
+    // Publishes a batch, waiting for slow subscribers when the ring is full
+    void publish(vector<ChangeEvent>& batch) {
+        uint64_t next = published.load(memory_order_relaxed);
+        uint64_t stalls = 0;
+        for (ChangeEvent& e : batch) {
+            while (next - slowestCursor(next) >= slots.size()) {
+                published.store(next, memory_order_seq_cst); // Let subscribers see what is there
+                notifySubscribers();
+                dispatcherStalled.store(true);
+                stalls++;
+                unique_lock<mutex> lock(progressMtx);
+                progressCv.wait_for(lock, chrono::milliseconds(1));
+                dispatcherStalled.store(false);
+            }
+            e.seq = ++next;
+            slots[(next - 1) % slots.size()] = e;
+        }
+        published.store(next, memory_order_seq_cst);
+        notifySubscribers();
+        double lagUs = batch.empty() ? 0 : (monotonicNanos() - batch.front().monotonicNs) / 1000.0;
+        lock_guard<mutex> lock(statsMtx);
+        stats.published += batch.size();
+        stats.stalls += stalls;
+        stats.maxDispatchLagUs = max(stats.maxDispatchLagUs, lagUs);
+    }
+
+    void notifySubscribers() {
+        if (waiters.load() == 0) return;
+        lock_guard<mutex> lock(dataMtx);
+        dataCv.notify_all();
+    }
+
+    void drainRing(vector<ChangeEvent>& batch) {
+        ChangeEvent e;
+        while (true) {
+            batch.clear();
+            while (batch.size() < 256 && ingest.tryPop(e)) batch.push_back(e);
+            if (batch.empty()) return;
+            publish(batch);
+        }
+    }
+
+    // Swaps spill files so producers keep spilling while this one is read
+    void drainSpill(vector<ChangeEvent>& batch) {
+        while (true) {
+            {
+                lock_guard<mutex> lock(spillMtx);
+                if (!spillFile || !drainFile || ftell(spillFile) == 0) {
+                    spilling.store(false, memory_order_release);
+                    return;
+                }
+                swap(spillFile, drainFile);
+            }
+            drainRing(batch); // Older than anything in the file
+            fflush(drainFile);
+            rewind(drainFile);
+            batch.resize(256);
+            size_t n;
+            while ((n = fread(batch.data(), sizeof(ChangeEvent), 256, drainFile)) > 0) {
+                batch.resize(n);
+                publish(batch);
+                batch.resize(256);
+            }
+            rewind(drainFile);
+            if (ftruncate(fileno(drainFile), 0) != 0) {
+                fclose(drainFile);
+                drainFile = tmpfile();
+            }
+        }
+    }
+
+    void dispatchLoop() {
+        vector<ChangeEvent> batch;
+        batch.reserve(256);
+        while (true) {
+            drainRing(batch);
+            if (spilling.load(memory_order_acquire)) {
+                drainSpill(batch);
+                continue;
+            }
+            unique_lock<mutex> lock(wakeMtx);
+            if (stopping) return;
+            dispatcherIdle.store(true);
+            ChangeEvent probe;
+            if (ingest.tryPop(probe)) { // Arrived after the drain
+                dispatcherIdle.store(false);
+                lock.unlock();
+                batch.assign(1, probe);
+                publish(batch);
+                continue;
+            }
+            wakeCv.wait_for(lock, chrono::milliseconds(10));
+            dispatcherIdle.store(false);
+        }
+    }
+
+public:
+    explicit ChangeStream(size_t ingestCapacity = 1 << 14, size_t broadcastCapacity = 1 << 14)
+        : ingest(ingestCapacity), slots(max<size_t>(broadcastCapacity, 1)),
+          spillFile(tmpfile()), drainFile(tmpfile()) {
+        dispatcher = thread(&ChangeStream::dispatchLoop, this);
+    }
+
+    ChangeStream(const ChangeStream&) = delete;
+    ChangeStream& operator=(const ChangeStream&) = delete;
+
+    // Drop every Subscription first
+    ~ChangeStream() {
+        {
+            lock_guard<mutex> lock(wakeMtx);
+            lock_guard<mutex> data(dataMtx);
+            stopping = true;
+        }
+        wakeCv.notify_one();
+        dataCv.notify_all();
+        dispatcher.join();
+        if (spillFile) fclose(spillFile);
+        if (drainFile) fclose(drainFile);
+    }
+
+    void onPosting(const Posting& posting) override {
+        ChangeEvent e;
+        e.type = posting.type;
+        e.amount = posting.amount;
+        e.balanceAfter = posting.balanceAfter;
+        e.monotonicNs = monotonicNanos();
+        size_t n = min(posting.accountNumber.size(), sizeof(e.accountNumber) - 1);
+        memcpy(e.accountNumber, posting.accountNumber.data(), n);
+        if (spilling.load(memory_order_acquire) || !ingest.tryPush(e)) {
+            lock_guard<mutex> lock(spillMtx);
+            if (spilling.load(memory_order_relaxed) || !ingest.tryPush(e)) {
+                spilling.store(true, memory_order_release);
+                if (spillFile) fwrite(&e, sizeof e, 1, spillFile); // Else lost, but still counted
+                spilled.fetch_add(1, memory_order_relaxed);
+            }
+        }
+        wakeDispatcher();
+    }
+
+    // Starts at the next event published
+    unique_ptr<Subscription> subscribe() {
+        lock_guard<mutex> lock(subsMtx);
+        unique_ptr<Subscription> sub(new Subscription(this, published.load(memory_order_acquire)));
+        subscribers.push_back(sub.get());
+        return sub;
+    }
+
+    ChangeStreamStats getStats() {
+        lock_guard<mutex> lock(statsMtx);
+        ChangeStreamStats s = stats;
+        s.spilled = spilled.load(memory_order_relaxed);
+        return s;
+    }
+};
+
+// ---------------- Customer Notifications ----------------
+/*
+Sends balance-change alerts to customers off the posting path.
+- NotificationService reads postings from a ChangeStream subscription on
+  its own thread, so an ATM never waits for an SMS or push gateway.
+- Customers register a destination (phone number, push token) per
+  account with the alerts they want: every posting, withdrawals above a
+  threshold, or the balance dropping below one.
+- Alerts are batched per destination and flushed when a batch is full or
+  its oldest alert has waited `maxDelay`. One sink call carries one
+  destination's batch.
+- A batch that fails to deliver is set aside and retried after a backoff
+  that starts at RETRY_BACKOFF and doubles with each attempt, per
+  destination; it is dropped after MAX_ATTEMPTS. Alerts raised meanwhile
+  start the next batch, which waits behind it.
+*/
+struct Notification {
+    string destination;
+    string accountNumber;
+    string text;
+    int64_t postedNs = 0; // Monotonic time of the posting
+};
+
+class INotificationSink {
+public:
+    // Delivers a batch for one destination; false to have it retried
+    virtual bool deliver(const string& destination, const vector<Notification>& batch) = 0;
+    virtual ~INotificationSink() {}
+};
+
+// Stand-in for an SMS/push gateway: one line per alert, one write per batch
+class FileNotificationSink : public INotificationSink {
+private:
+    FILE* file;
+    string buffer;
+
+public:
+    explicit FileNotificationSink(const string& path) : file(fopen(path.c_str(), "a")) {}
+    FileNotificationSink(const FileNotificationSink&) = delete;
+    FileNotificationSink& operator=(const FileNotificationSink&) = delete;
+    ~FileNotificationSink() {
+        if (file) fclose(file);
+    }
+
+    bool isOpen() const { return file != nullptr; }
+
+    bool deliver(const string& destination, const vector<Notification>& batch) override {
+        if (!file) return false;
+        buffer.clear();
+        for (const auto& n : batch) {
+            buffer += destination;
+            buffer += '\t';
+            buffer += n.accountNumber;
+            buffer += '\t';
+            buffer += n.text;
+            buffer += '\n';
+        }
+        return fwrite(buffer.data(), 1, buffer.size(), file) == buffer.size() && fflush(file) == 0;
+    }
+};
+
+struct AlertRule {
+    bool everyPosting = false;
+    double largeWithdrawal = 0; // Alert on withdrawals at least this big; 0 = off
+    double lowBalance = 0;      // Alert when the balance drops below this; 0 = off
+};
+
+struct NotificationStats {
+    uint64_t generated = 0;
+    uint64_t delivered = 0;
+    uint64_t batches = 0;
+    uint64_t failedAttempts = 0;
+    uint64_t dropped = 0;
+    double totalLagUs = 0; // Posting -> delivered
+    double maxLagUs = 0;
+    double averageLagUs() const { return delivered ? totalLagUs / delivered : 0; }
+};
+
+class NotificationService {
+public:
+    static const int MAX_ATTEMPTS = 3;
+    static constexpr chrono::milliseconds RETRY_BACKOFF{100};
+
+private:
+    struct Registration {
+        string destination;
+        AlertRule rule;
+    };
+    struct Pending {
+        vector<Notification> batch;    // Collecting new alerts
+        vector<Notification> retrying; // Failed to deliver; sent again at retryAtNs
+        int attempts = 0;
+        int64_t retryAtNs = 0;
+    };
+
+    unique_ptr<ChangeStream::Subscription> subscription;
+    INotificationSink* sink;
+    size_t maxBatch;
+    chrono::milliseconds maxDelay;
+
+    mutex registrationsMtx;
+    unordered_map<string, vector<Registration>> registrations; // By account
+
+    unordered_map<string, Pending> pending; // By destination; worker thread only
+    vector<Registration> matched;           // generate()'s copy of an account's registrations
+    mutex statsMtx;
+    NotificationStats stats;
+    atomic<bool> stopping{false};
+    thread worker;
+
+    static string formatAmount(double amount) {
+        char buf[32];
+        auto res = to_chars(buf, buf + sizeof buf, amount, chars_format::fixed, 2);
+        return string(buf, res.ptr);
+    }
+
+    // Clears `batch` once the sink has taken it
+    bool send(const string& destination, vector<Notification>& batch, NotificationStats& delta) {
+        if (!sink->deliver(destination, batch)) return false;
+        int64_t done = monotonicNanos();
+        delta.delivered += batch.size();
+        delta.batches++;
+        for (const auto& n : batch) {
+            double lagUs = (done - n.postedNs) / 1000.0;
+            delta.totalLagUs += lagUs;
+            delta.maxLagUs = max(delta.maxLagUs, lagUs);
+        }
+        batch.clear();
+        return true;
+    }
+
+    // After p.retrying failed to send
+    void backOff(Pending& p, NotificationStats& delta) {
+        delta.failedAttempts++;
+        if (++p.attempts < MAX_ATTEMPTS) {
+            int64_t backoffNs = chrono::duration_cast<chrono::nanoseconds>(RETRY_BACKOFF).count();
+            p.retryAtNs = monotonicNanos() + (backoffNs << (p.attempts - 1));
+            return;
+        }
+        delta.dropped += p.retrying.size();
+        p.retrying.clear();
+        p.attempts = 0;
+    }
+
+    // Retries a failed batch once its backoff is over (at once when
+    // `retryNow`), then sends p.batch if `sendBatch` and nothing is left to
+    // retry ahead of it. Returns whether the destination has nothing pending.
+    bool deliver(const string& destination, Pending& p, bool sendBatch, bool retryNow, NotificationStats& delta) {
+        if (!p.retrying.empty()) {
+            if (!retryNow && monotonicNanos() < p.retryAtNs) return false;
+            if (send(destination, p.retrying, delta)) p.attempts = 0;
+            else backOff(p, delta);
+            if (!p.retrying.empty()) return false;
+        }
+        if (sendBatch && !p.batch.empty() && !send(destination, p.batch, delta)) {
+            p.retrying.swap(p.batch);
+            backOff(p, delta);
+        }
+        return p.batch.empty() && p.retrying.empty();
+    }
+
+    // Copies the account's registrations out so the sink is never called
+    // with registrationsMtx held
+    void generate(const ChangeEvent& e, NotificationStats& delta) {
+        {
+            lock_guard<mutex> lock(registrationsMtx);
+            auto it = registrations.find(string(e.account()));
+            if (it == registrations.end()) return;
+            matched = it->second;
+        }
+        bool withdrawal = e.type == TransactionType::WITHDRAW;
+        for (const auto& reg : matched) {
+            string text;
+            if (withdrawal && reg.rule.largeWithdrawal > 0 && e.amount >= reg.rule.largeWithdrawal) {
+                text = "Large withdrawal of $" + formatAmount(e.amount) + ". Balance: $" + formatAmount(e.balanceAfter);
+            } else if (withdrawal && reg.rule.lowBalance > 0 && e.balanceAfter < reg.rule.lowBalance &&
+                       e.balanceAfter + e.amount >= reg.rule.lowBalance) {
+                text = "Balance is low: $" + formatAmount(e.balanceAfter);
+            } else if (reg.rule.everyPosting) {
+                text = string(withdrawal ? "Withdrawal" : "Deposit") + " of $" + formatAmount(e.amount) +
+                       ". Balance: $" + formatAmount(e.balanceAfter);
+            } else {
+                continue;
+            }
+            auto pit = pending.try_emplace(reg.destination).first;
+            pit->second.batch.push_back({reg.destination, string(e.account()), move(text), e.monotonicNs});
+            delta.generated++;
+            if (pit->second.batch.size() >= maxBatch && deliver(pit->first, pit->second, true, false, delta))
+                pending.erase(pit);
+        }
+    }
+
+    // Delivers overdue batches and due retries (all of them when `everything`)
+    void flush(bool everything, NotificationStats& delta) {
+        int64_t cutoff = monotonicNanos() - chrono::duration_cast<chrono::nanoseconds>(maxDelay).count();
+        for (auto it = pending.begin(); it != pending.end();) {
+            const auto& batch = it->second.batch;
+            bool due = everything || (!batch.empty() && batch.front().postedNs <= cutoff);
+            if (deliver(it->first, it->second, due, everything, delta)) it = pending.erase(it);
+            else ++it;
+        }
+    }
+
+    void publishStats(const NotificationStats& delta) {
+        lock_guard<mutex> lock(statsMtx);
+        stats.generated += delta.generated;
+        stats.delivered += delta.delivered;
+        stats.batches += delta.batches;
+        stats.failedAttempts += delta.failedAttempts;
+        stats.dropped += delta.dropped;
+        stats.totalLagUs += delta.totalLagUs;
+        stats.maxLagUs = max(stats.maxLagUs, delta.maxLagUs);
+    }
+
+    void run() {
+        vector<ChangeEvent> events;
+        auto tick = max(min(maxDelay, chrono::milliseconds(10)), chrono::milliseconds(1));
+        while (!stopping.load(memory_order_acquire)) {
+            NotificationStats delta;
+            events.clear();
+            if (subscription->poll(events, 1024) == 0) {
+                flush(false, delta);
+                publishStats(delta);
+                subscription->wait(pending.empty() ? chrono::milliseconds(100) : tick);
+                continue;
+            }
+            for (const auto& e : events) generate(e, delta);
+            flush(false, delta);
+            publishStats(delta);
+        }
+        NotificationStats delta;
+        flush(true, delta);
+        publishStats(delta);
+    }
+
+public:
+    NotificationService(ChangeStream& stream, INotificationSink* notificationSink, size_t batchSize = 64,
+                        chrono::milliseconds delay = chrono::milliseconds(50))
+        : subscription(stream.subscribe()), sink(notificationSink), maxBatch(max<size_t>(batchSize, 1)),
+          maxDelay(delay) {
+        worker = thread(&NotificationService::run, this);
+    }
+
+    NotificationService(const NotificationService&) = delete;
+    NotificationService& operator=(const NotificationService&) = delete;
+
+    // Delivers what is pending, then stops
+    ~NotificationService() {
+        stopping.store(true, memory_order_release);
+        worker.join();
+    }
+
+    void registerAlerts(const string& accNum, const string& destination, const AlertRule& rule) {
+        lock_guard<mutex> lock(registrationsMtx);
+        auto& list = registrations[accNum];
+        for (auto& reg : list) {
+            if (reg.destination == destination) {
+                reg.rule = rule;
+                return;
+            }
+        }
+        list.push_back({destination, rule});
+    }
+
+    void unregisterAlerts(const string& accNum, const string& destination) {
+        lock_guard<mutex> lock(registrationsMtx);
+        auto it = registrations.find(accNum);
+        if (it == registrations.end()) return;
+        auto& list = it->second;
+        list.erase(remove_if(list.begin(), list.end(),
+                             [&](const Registration& reg) { return reg.destination == destination; }),
+                   list.end());
+        if (list.empty()) registrations.erase(it);
+    }
+
+    NotificationStats getStats() {
+        lock_guard<mutex> lock(statsMtx);
+        return stats;
+    }
+};
+
+// ---------------- Event-Sourced Projections ----------------
+/*
+An append-only log of account events, and read models folded from it.
+- EventLog records each posting (it is an IPostingObserver) plus an
+  OPENED event carrying the opening balance, which the caller records
+  once per account. Entries are never changed, so any account state is
+  a fold over the log, e.g. foldBalance().
+- Events are 32-byte PODs in fixed-size chunks that never move. Readers
+  scan the committed prefix without locks; only appends lock.
+- Projections (balance, mini statement, daily aggregates) implement
+  IProjection. ProjectionEngine applies new events incrementally on
+  read. rebuild() and add() fold the whole log in parallel: each worker
+  takes the accounts with id % workers == its index, and since the parts
+  cover disjoint accounts, merging them is just moving state across.
+  Reads continue on the old projections until the new ones are swapped in.
+*/
+enum class AccountEventKind : uint8_t { OPENED, DEPOSITED, WITHDRAWN };
+
+struct AccountEvent {
+    uint64_t seq;
+    int64_t unixTime;
+    double amount;      // The opening balance for OPENED
+    uint32_t accountId; // Interned by the EventLog
+    AccountEventKind kind;
+};
+
+class EventLog : public IPostingObserver {
+public:
+    static const size_t CHUNK_BITS = 16;
+    static const size_t CHUNK = size_t(1) << CHUNK_BITS;
+    static const size_t MAX_CHUNKS = size_t(1) << 16;
+
+private:
+    unique_ptr<atomic<AccountEvent*>[]> chunks{new atomic<AccountEvent*>[MAX_CHUNKS]()};
+    atomic<uint64_t> committed{0};
+    mutable mutex appendMtx; // Also guards the account dictionary
+    unordered_map<string, uint32_t> ids;
+    vector<string> numbers;
+
+    uint32_t internLocked(string_view accNum) {
+        auto it = ids.find(string(accNum));
+        if (it != ids.end()) return it->second;
+        uint32_t id = (uint32_t)numbers.size();
+        numbers.emplace_back(accNum);
+        ids.emplace(numbers.back(), id);
+        return id;
+    }
+
+public:
+    EventLog() = default;
+    EventLog(const EventLog&) = delete;
+    EventLog& operator=(const EventLog&) = delete;
+
+    ~EventLog() {
+        for (size_t i = 0; i < MAX_CHUNKS; i++) delete[] chunks[i].load(memory_order_relaxed);
+    }
+
+    // Returns the event's sequence number, or 0 if the log is full
+    uint64_t append(AccountEventKind kind, string_view accNum, double amount, int64_t unixTime) {
+        lock_guard<mutex> lock(appendMtx);
+        uint64_t index = committed.load(memory_order_relaxed);
+        size_t chunk = index >> CHUNK_BITS;
+        if (chunk == MAX_CHUNKS) return 0;
+        AccountEvent* events = chunks[chunk].load(memory_order_relaxed);
+        if (!events) {
+            events = new AccountEvent[CHUNK];
+            chunks[chunk].store(events, memory_order_relaxed); // Published with `committed`
+        }
+        events[index & (CHUNK - 1)] = {index + 1, unixTime, amount, internLocked(accNum), kind};
+        committed.store(index + 1, memory_order_release);
+        return index + 1;
+    }
+
+    uint64_t recordOpening(const string& accNum, double balance) {
+        return append(AccountEventKind::OPENED, accNum, balance, (int64_t)time(0));
+    }
+
+    void onPosting(const Posting& posting) override {
+        append(posting.type == TransactionType::DEPOSIT ? AccountEventKind::DEPOSITED : AccountEventKind::WITHDRAWN,
+               posting.accountNumber, posting.amount, (int64_t)time(0));
+    }
+
+    uint64_t size() const { return committed.load(memory_order_acquire); }
+
+    // Calls fn(event) for events [from, to); `to` must not exceed size()
+    template <typename Fn>
+    void scan(uint64_t from, uint64_t to, Fn fn) const {
+        while (from < to) {
+            const AccountEvent* events = chunks[from >> CHUNK_BITS].load(memory_order_relaxed);
+            uint64_t chunkEnd = min(to, ((from >> CHUNK_BITS) + 1) << CHUNK_BITS);
+            for (uint64_t i = from; i < chunkEnd; i++) fn(events[i & (CHUNK - 1)]);
+            from = chunkEnd;
+        }
+    }
+
+    bool findAccount(const string& accNum, uint32_t& id) const {
+        lock_guard<mutex> lock(appendMtx);
+        auto it = ids.find(accNum);
+        if (it == ids.end()) return false;
+        id = it->second;
+        return true;
+    }
+
+    string accountNumber(uint32_t id) const {
+        lock_guard<mutex> lock(appendMtx);
+        return id < numbers.size() ? numbers[id] : string();
+    }
+
+    // Account state straight from the log; -1 for an unknown account
+    double foldBalance(const string& accNum) const {
+        uint32_t id;
+        if (!findAccount(accNum, id)) return -1;
+        double balance = 0;
+        scan(0, size(), [&](const AccountEvent& e) {
+            if (e.accountId != id) return;
+            if (e.kind == AccountEventKind::OPENED) balance = e.amount;
+            else balance += e.kind == AccountEventKind::DEPOSITED ? e.amount : -e.amount;
+        });
+        return balance;
+    }
+};
+
+class IProjection {
+public:
+    virtual void apply(const AccountEvent& e) = 0;
+    virtual void clear() = 0;
+    // A new, empty projection of the same kind
+    virtual unique_ptr<IProjection> emptyCopy() const = 0;
+    // Takes over the state of `part`, which covers accounts this one lacks
+    virtual void absorb(IProjection& part) = 0;
+    virtual ~IProjection() {}
+};
+
+class BalanceProjection : public IProjection {
+private:
+    vector<double> balances; // By account id
+    vector<char> known;
+
+public:
+    void apply(const AccountEvent& e) override {
+        if (e.accountId >= balances.size()) {
+            balances.resize(e.accountId + 1);
+            known.resize(e.accountId + 1);
+        }
+        known[e.accountId] = 1;
+        if (e.kind == AccountEventKind::OPENED) balances[e.accountId] = e.amount;
+        else balances[e.accountId] += e.kind == AccountEventKind::DEPOSITED ? e.amount : -e.amount;
+    }
+
+    void clear() override {
+        balances.clear();
+        known.clear();
+    }
+
+    unique_ptr<IProjection> emptyCopy() const override { return make_unique<BalanceProjection>(); }
+
+    void absorb(IProjection& part) override {
+        auto& other = static_cast<BalanceProjection&>(part);
+        if (other.balances.size() > balances.size()) {
+            balances.resize(other.balances.size());
+            known.resize(other.balances.size());
+        }
+        for (size_t id = 0; id < other.balances.size(); id++) {
+            if (!other.known[id]) continue;
+            balances[id] = other.balances[id];
+            known[id] = 1;
+        }
+    }
+
+    bool balance(uint32_t accountId, double& out) const {
+        if (accountId >= balances.size() || !known[accountId]) return false;
+        out = balances[accountId];
+        return true;
+    }
+};
+
+// The latest LINES postings of each account, oldest first
+class MiniStatementProjection : public IProjection {
+public:
+    static const size_t LINES = 10;
+
+private:
+    struct Ring {
+        AccountEvent lines[LINES];
+        uint64_t count = 0;
+    };
+    vector<Ring> rings; // By account id
+
+public:
+    void apply(const AccountEvent& e) override {
+        if (e.kind == AccountEventKind::OPENED) return;
+        if (e.accountId >= rings.size()) rings.resize(e.accountId + 1);
+        Ring& ring = rings[e.accountId];
+        ring.lines[ring.count++ % LINES] = e;
+    }
+
+    void clear() override { rings.clear(); }
+
+    unique_ptr<IProjection> emptyCopy() const override { return make_unique<MiniStatementProjection>(); }
+
+    void absorb(IProjection& part) override {
+        auto& other = static_cast<MiniStatementProjection&>(part);
+        if (other.rings.size() > rings.size()) rings.resize(other.rings.size());
+        for (size_t id = 0; id < other.rings.size(); id++) {
+            if (other.rings[id].count) rings[id] = other.rings[id];
+        }
+    }
+
+    vector<AccountEvent> statement(uint32_t accountId) const {
+        vector<AccountEvent> out;
+        if (accountId >= rings.size()) return out;
+        const Ring& ring = rings[accountId];
+        uint64_t first = ring.count > LINES ? ring.count - LINES : 0;
+        for (uint64_t i = first; i < ring.count; i++) out.push_back(ring.lines[i % LINES]);
+        return out;
+    }
+};
+
+struct DailyTotals {
+    double deposited = 0;
+    double withdrawn = 0;
+    uint32_t deposits = 0;
+    uint32_t withdrawals = 0;
+};
+
+// Per account and UTC day
+class DailyAggregateProjection : public IProjection {
+private:
+    unordered_map<uint64_t, DailyTotals> days; // (account id << 32) | day number
+
+    static uint64_t key(uint32_t accountId, int64_t day) { return (uint64_t)accountId << 32 | (uint32_t)day; }
+
+public:
+    void apply(const AccountEvent& e) override {
+        if (e.kind == AccountEventKind::OPENED) return;
+        DailyTotals& t = days[key(e.accountId, e.unixTime / 86400)];
+        if (e.kind == AccountEventKind::DEPOSITED) {
+            t.deposited += e.amount;
+            t.deposits++;
+        } else {
+            t.withdrawn += e.amount;
+            t.withdrawals++;
+        }
+    }
+
+    void clear() override { days.clear(); }
+
+    unique_ptr<IProjection> emptyCopy() const override { return make_unique<DailyAggregateProjection>(); }
+
+    void absorb(IProjection& part) override {
+        auto& other = static_cast<DailyAggregateProjection&>(part);
+        if (days.empty()) swap(days, other.days);
+        else days.insert(other.days.begin(), other.days.end());
+    }
+
+    DailyTotals totals(uint32_t accountId, int64_t unixTime) const {
+        auto it = days.find(key(accountId, unixTime / 86400));
+        return it == days.end() ? DailyTotals() : it->second;
+    }
+};
+
+class ProjectionEngine {
+private:
+    const EventLog& log;
+    mutex rebuildMtx; // Serializes add and rebuild
+    mutex mtx;        // Guards projection state and position
+    vector<unique_ptr<IProjection>> projections;
+    uint64_t position = 0; // Events applied so far
+
+    // Folds events [0, end) into fresh copies of `prototypes` on `workers` threads
+    vector<unique_ptr<IProjection>> build(const vector<const IProjection*>& prototypes, uint64_t end,
+                                          unsigned workers) const {
+        workers = max(workers, 1u);
+        vector<vector<unique_ptr<IProjection>>> parts(workers);
+        auto work = [&](unsigned w) {
+            for (const IProjection* proto : prototypes) parts[w].push_back(proto->emptyCopy());
+            log.scan(0, end, [&](const AccountEvent& e) {
+                if (e.accountId % workers != w) return;
+                for (auto& part : parts[w]) part->apply(e);
+            });
+        };
+        vector<thread> threads;
+        for (unsigned w = 1; w < workers; w++) threads.emplace_back(work, w);
+        work(0);
+        for (auto& t : threads) t.join();
+        for (unsigned w = 1; w < workers; w++) {
+            for (size_t i = 0; i < prototypes.size(); i++) parts[0][i]->absorb(*parts[w][i]);
+        }
+        return move(parts[0]);
+    }
+
+    // Caller holds mtx
+    void catchUpLocked() {
+        uint64_t end = log.size();
+        log.scan(position, end, [&](const AccountEvent& e) {
+            for (auto& p : projections) p->apply(e);
+        });
+        position = end;
+    }
+
+public:
+    explicit ProjectionEngine(const EventLog& eventLog) : log(eventLog) {}
+
+    // Registers a new read model, built from the whole log first. The
+    // pointer stays valid for the engine's lifetime; use it inside read().
+    template <typename P>
+    P* add(unsigned workers = thread::hardware_concurrency()) {
+        lock_guard<mutex> serial(rebuildMtx);
+        P prototype;
+        uint64_t end = log.size();
+        unique_ptr<IProjection> built = move(build({&prototype}, end, workers)[0]);
+        P* result = static_cast<P*>(built.get());
+        lock_guard<mutex> lock(mtx);
+        // Bring the new one up to the others' position, or them up to its
+        uint64_t target = max(end, position);
+        log.scan(end, target, [&](const AccountEvent& e) { built->apply(e); });
+        log.scan(position, target, [&](const AccountEvent& e) {
+            for (auto& p : projections) p->apply(e);
+        });
+        position = target;
+        projections.push_back(move(built));
+        return result;
+    }
+
+    // Discards every projection and folds the whole log again
+    // Returns the number of events folded
+    uint64_t rebuild(unsigned workers = thread::hardware_concurrency()) {
+        lock_guard<mutex> serial(rebuildMtx);
+        vector<const IProjection*> prototypes;
+        for (const auto& p : projections) prototypes.push_back(p.get()); // Only add() changes the list
+        uint64_t end = log.size();
+        vector<unique_ptr<IProjection>> rebuilt = build(prototypes, end, workers);
+        lock_guard<mutex> lock(mtx);
+        log.scan(end, position, [&](const AccountEvent& e) {
+            for (auto& p : rebuilt) p->apply(e);
+        });
+        position = max(end, position);
+        for (size_t i = 0; i < projections.size(); i++) {
+            projections[i]->clear();
+            projections[i]->absorb(*rebuilt[i]);
+        }
+        return end;
+    }
+
+    // Runs fn() with every projection caught up with the log
+    template <typename Fn>
+    auto read(Fn fn) {
+        lock_guard<mutex> lock(mtx);
+        catchUpLocked();
+        return fn();
+    }
+};
+
+// ---------------- Cash Cassettes ----------------
+/*
+Each ATM holds a few cassettes, one denomination per cassette.
+- Before calling IBankService::withdraw, the ATM asks the CashDispenser
+  for a plan; amounts it cannot pay out are rejected up front so the
+  account is never debited for cash that cannot leave the machine.
+- Planning uses tables precomputed in the constructor:
+  reachable[pref][k][a] says whether amount `a` can be formed from the
+  denominations at positions k..n-1 of that preference order (ignoring
+  counts). Undispensable amounts are rejected with one lookup, and the
+  inventory-bounded search below prunes every dead branch with the same
+  table, so a plan takes a handful of steps.
+*/
+enum class DispensePreference { LARGE_NOTES, SMALL_NOTES };
+
+struct CashCassette {
+    int denomination;
+    int count;
+};
+
+struct DispensePlan {
+    static const int MAX_CASSETTES = 8;
+    bool ok = false;
+    int notes[MAX_CASSETTES] = {}; // Notes to take from each cassette (by cassette index)
+};
+
+class CashDispenser {
+private:
+    vector<CashCassette> cassettes;
+    int maxAmount;
+    vector<int> order[2];       // Cassette indices in the order each preference tries them
+    vector<char> reachable[2];  // reachable[pref][k * (maxAmount + 1) + a]
+
+    bool canReach(int pref, size_t k, int amount) const {
+        if (k == order[pref].size()) return amount == 0;
+        return reachable[pref][k * (maxAmount + 1) + amount];
+    }
+
+    void buildTable(int pref) {
+        size_t n = order[pref].size();
+        reachable[pref].assign(n * (maxAmount + 1), 0);
+        for (size_t k = n; k-- > 0;) {
+            int denom = cassettes[order[pref][k]].denomination;
+            char* row = &reachable[pref][k * (maxAmount + 1)];
+            for (int a = 0; a <= maxAmount; a++) {
+                row[a] = canReach(pref, k + 1, a) || (a >= denom && row[a - denom]);
+            }
+        }
+    }
+
+    // Depth-first over the preference order, trying the most notes first.
+    // `cashFrom[k]` is the cash left in cassettes k.. of the order, so a
+    // branch needing more than that is cut without enumerating counts.
+    bool search(int pref, size_t k, int amount, const long long* cashFrom, DispensePlan& plan) const {
+        if (k == order[pref].size()) return amount == 0;
+        if (amount > cashFrom[k] || !canReach(pref, k, amount)) return false;
+        int idx = order[pref][k];
+        int denom = cassettes[idx].denomination;
+        // The remaining cassettes must cover what this one does not
+        int fewest = (int)max(0LL, (amount - cashFrom[k + 1] + denom - 1) / denom);
+        for (int take = min(amount / denom, cassettes[idx].count); take >= fewest; take--) {
+            plan.notes[idx] = take;
+            if (search(pref, k + 1, amount - take * denom, cashFrom, plan)) return true;
+        }
+        plan.notes[idx] = 0;
+        return false;
+    }
+
+public:
+    // Cassettes loaded with a denomination below 1 or a negative count are
+    // left out: either would let a plan pay out notes that do not exist
+    CashDispenser(vector<CashCassette> c, int maxWithdrawal)
+        : maxAmount(max(maxWithdrawal, 0)) {
+        for (const CashCassette& cassette : c) {
+            if (cassette.denomination > 0 && cassette.count >= 0) cassettes.push_back(cassette);
+        }
+        if (cassettes.size() > DispensePlan::MAX_CASSETTES)
+            cassettes.resize(DispensePlan::MAX_CASSETTES);
+        for (int pref = 0; pref < 2; pref++) {
+            for (size_t i = 0; i < cassettes.size(); i++) order[pref].push_back((int)i);
+            sort(order[pref].begin(), order[pref].end(), [&](int a, int b) {
+                return pref == (int)DispensePreference::LARGE_NOTES
+                    ? cassettes[a].denomination > cassettes[b].denomination
+                    : cassettes[a].denomination < cassettes[b].denomination;
+            });
+            buildTable(pref);
+        }
+    }
+
+    DispensePlan plan(double amount, DispensePreference preference) const {
+        DispensePlan result;
+        if (amount <= 0 || amount > maxAmount || amount != floor(amount)) return result;
+        int pref = (int)preference;
+        long long cashFrom[DispensePlan::MAX_CASSETTES + 1] = {};
+        for (size_t k = order[pref].size(); k-- > 0;) {
+            const CashCassette& c = cassettes[order[pref][k]];
+            cashFrom[k] = cashFrom[k + 1] + (long long)c.count * c.denomination;
+        }
+        if (amount > cashFrom[0]) return result; // More than the whole inventory
+        result.ok = search(pref, 0, (int)amount, cashFrom, result);
+        return result;
+    }
+
+    void dispense(const DispensePlan& plan) {
+        for (size_t i = 0; i < cassettes.size(); i++) {
+            cassettes[i].count -= plan.notes[i];
+        }
+    }
+
+    const vector<CashCassette>& getCassettes() const { return cassettes; }
+};
+
+// ---------------- Input Parsing ----------------
+/*
+Parses terminal input without allocating and independent of locale.
+- Choices are plain integers; amounts are fixed-point Money in cents.
+- The whole line must match (surrounding blanks are ignored), so "12abc",
+  "-5", "1e3" or "10.005" are rejected before anything reaches the bank.
+*/
+struct Money {
+    int64_t cents = 0;
+
+    double toDouble() const { return cents / 100.0; }
+};
+
+inline string_view trimBlanks(string_view text) {
+    while (!text.empty() && (text.front() == ' ' || text.front() == '\t')) text.remove_prefix(1);
+    while (!text.empty() && (text.back() == ' ' || text.back() == '\t')) text.remove_suffix(1);
+    return text;
+}
+
+inline bool parseChoice(string_view text, int& choice) {
+    text = trimBlanks(text);
+    const char* end = text.data() + text.size();
+    auto [ptr, ec] = from_chars(text.data(), end, choice);
+    return ec == errc() && ptr == end && !text.empty();
+}
+
+// Accepts "12", "12.5" and "12.50"; rejects signs, exponents and empty parts
+inline bool parseMoney(string_view text, Money& out) {
+    text = trimBlanks(text);
+    if (text.empty() || text.front() < '0' || text.front() > '9') return false;
+    const char* p = text.data();
+    const char* end = p + text.size();
+    int64_t whole = 0;
+    auto [afterWhole, ec] = from_chars(p, end, whole);
+    if (ec != errc() || whole > INT64_MAX / 100 - 1) return false;
+    int64_t fraction = 0;
+    if (afterWhole != end) {
+        if (*afterWhole != '.') return false;
+        const char* digits = afterWhole + 1;
+        size_t count = end - digits;
+        if (count == 0 || count > 2 || *digits < '0' || *digits > '9') return false;
+        auto [afterFraction, ec2] = from_chars(digits, end, fraction);
+        if (ec2 != errc() || afterFraction != end) return false;
+        if (count == 1) fraction *= 10;
+    }
+    out.cents = whole * 100 + fraction;
+    return true;
+}
+
+// ---------------- Session Checkpoints ----------------
+/*
+A front end checkpoints each session to a small local file so that, after
+a restart, it can reattach the customer and learn the outcome of the
+posting that was in flight instead of guessing.
+- Every posting carries a request id (session id + sequence number). The
+  checkpoint is saved before the request is sent and again after the
+  reply, so the in-flight request id is always on disk.
+- The bank applies a request id at most once and can report its outcome
+  (IBankService::getRequestStatus), so a restart never double-posts.
+- Files are replaced atomically: write a temp file, fsync, rename.
+*/
+struct SessionCheckpoint {
+    string sessionId;
+    string accountNumber;        // Empty when nobody is logged in
+    uint64_t nextSequence = 1;
+    string pendingRequestId;     // Last posting sent to the bank
+    char pendingOp = 0;          // 'D' deposit, 'W' withdrawal, 'C' cash withdrawal
+    int64_t pendingCents = 0;
+    bool pendingReplied = false; // A reply arrived; its outcome is pendingApplied
+    bool pendingApplied = false;
+    bool cashDispensed = false;
+};
+
+class SessionCheckpointStore {
+private:
+    string path;
+
+public:
+    explicit SessionCheckpointStore(string filePath) : path(move(filePath)) {}
+
+    bool save(const SessionCheckpoint& c) {
+        string tmp = path + ".tmp";
+        FILE* f = fopen(tmp.c_str(), "w");
+        if (!f) return false;
+        fprintf(f, "session %s\naccount %s\nsequence %llu\nrequest %s\nop %d\ncents %lld\n"
+                   "replied %d\napplied %d\ndispensed %d\n",
+                c.sessionId.c_str(), c.accountNumber.c_str(), (unsigned long long)c.nextSequence,
+                c.pendingRequestId.c_str(), (int)c.pendingOp, (long long)c.pendingCents,
+                (int)c.pendingReplied, (int)c.pendingApplied, (int)c.cashDispensed);
+        bool ok = fflush(f) == 0 && fsync(fileno(f)) == 0;
+        ok = (fclose(f) == 0) && ok;
+        return ok && rename(tmp.c_str(), path.c_str()) == 0;
+    }
+
+    // False when there is no checkpoint (or it is unreadable)
+    bool load(SessionCheckpoint& c) const {
+        FILE* f = fopen(path.c_str(), "r");
+        if (!f) return false;
+        c = SessionCheckpoint();
+        int fields = 0;
+        char buf[256];
+        while (fgets(buf, sizeof buf, f)) {
+            string_view entry(buf);
+            while (!entry.empty() && (entry.back() == '\n' || entry.back() == '\r')) entry.remove_suffix(1);
+            size_t space = entry.find(' ');
+            if (space == string_view::npos) continue;
+            string_view key = entry.substr(0, space), value = entry.substr(space + 1);
+            long long number = 0;
+            from_chars(value.data(), value.data() + value.size(), number);
+            fields++;
+            if (key == "session") c.sessionId = value;
+            else if (key == "account") c.accountNumber = value;
+            else if (key == "sequence") c.nextSequence = (uint64_t)number;
+            else if (key == "request") c.pendingRequestId = value;
+            else if (key == "op") c.pendingOp = (char)number;
+            else if (key == "cents") c.pendingCents = number;
+            else if (key == "replied") c.pendingReplied = number;
+            else if (key == "applied") c.pendingApplied = number;
+            else if (key == "dispensed") c.cashDispensed = number;
+            else fields--;
+        }
+        fclose(f);
+        return fields == 9;
+    }
+
+    void clear() { remove(path.c_str()); }
+};
+
+// ---------------- Screen Buffer ----------------
+/*
+The ATM composes each screen (everything shown between two inputs) into
+one reusable buffer and hands it to the terminal in a single write.
+Numbers are formatted with to_chars straight into the buffer, matching
+the default iostream output ("870", "1010.5").
+*/
+class ScreenBuffer {
+private:
+    string text;
+
+public:
+    ScreenBuffer() { text.reserve(2048); }
+
+    template <typename T>
+    ScreenBuffer& operator<<(const T& value) {
+        if constexpr (is_convertible_v<const T&, string_view>) {
+            text.append(string_view(value));
+        } else if constexpr (is_same_v<T, char>) {
+            text.push_back(value);
+        } else {
+            static_assert(is_arithmetic_v<T>, "ScreenBuffer only formats text and numbers");
+            char buf[32];
+            to_chars_result r;
+            if constexpr (is_floating_point_v<T>) r = to_chars(buf, buf + sizeof buf, value, chars_format::general, 6);
+            else r = to_chars(buf, buf + sizeof buf, value);
+            text.append(buf, r.ptr);
+        }
+        return *this;
+    }
+
+    bool empty() const { return text.empty(); }
+    size_t capacity() const { return text.capacity(); }
+    string_view view() const { return text; }
+    void clear() { text.clear(); } // Keeps the capacity for the next screen
+};
+
+// ---------------- Terminal ----------------
+/*
+Everything the ATM shows or reads goes through ITerminal, so the same
+session logic can drive a console, a test script or a replayed
+production session.
+*/
+class ITerminal {
+public:
+    // Reads one line without its newline; false once input is exhausted
+    virtual bool readLine(string& line) = 0;
+    virtual void write(string_view text) = 0;
+    virtual ~ITerminal() {}
+};
+
+class ConsoleTerminal : public ITerminal {
+public:
+    bool readLine(string& line) override {
+        if (!getline(cin, line)) return false;
+        if (!line.empty() && line.back() == '\r') line.pop_back();
+        return true;
+    }
+
+    // One write and flush per screen
+    void write(string_view text) override {
+        cout.write(text.data(), text.size());
+        cout.flush();
+    }
+};
+
+// One scripted input line and the output the ATM produced before asking for it
+struct ScriptStep {
+    string output;
+    string input;
+};
+
+struct SessionTranscript {
+    vector<ScriptStep> steps;
+    string finalOutput;  // Output after the last input was consumed
+};
+
+class ScriptedTerminal : public ITerminal {
+private:
+    const vector<string>& script;
+    size_t next = 0;
+    string pending;
+    SessionTranscript transcript;
+
+public:
+    explicit ScriptedTerminal(const vector<string>& lines) : script(lines) {}
+
+    bool readLine(string& line) override {
+        if (next == script.size()) return false;
+        line = script[next++];
+        transcript.steps.push_back({move(pending), line});
+        pending.clear();
+        return true;
+    }
+
+    void write(string_view text) override { pending.append(text); }
+
+    SessionTranscript finish() {
+        transcript.finalOutput = move(pending);
+        pending.clear();
+        return move(transcript);
+    }
+};
+
+// ---------------- Session Coroutine ----------------
+/*
+A customer session runs as a C++20 coroutine (ATM::session) that
+suspends whenever it needs the next input line.
+- The frame holds only the session's locals; everything else lives in
+  the ATM object, so a suspended session costs one small heap frame.
+- Whoever owns the input resumes it: ATM::run reads a terminal and
+  blocks, while an event loop can call feedInput/closeInput for many
+  ATMs from a single thread.
+- Bank calls are synchronous IBankService calls, so the coroutine only
+  ever suspends for input.
+*/
+class SessionTask {
+public:
+    struct promise_type {
+        SessionTask get_return_object() {
+            return SessionTask(coroutine_handle<promise_type>::from_promise(*this));
+        }
+        suspend_always initial_suspend() noexcept { return {}; }
+        suspend_always final_suspend() noexcept { return {}; }
+        void return_void() {}
+        void unhandled_exception() { terminate(); }
+
+        // Frames are counted so session memory can be reported
+        static void* operator new(size_t size) {
+            frameBytes.fetch_add(size, memory_order_relaxed);
+            return ::operator new(size);
+        }
+        static void operator delete(void* frame, size_t size) {
+            frameBytes.fetch_sub(size, memory_order_relaxed);
+            ::operator delete(frame);
+        }
+    };
+
+    static size_t liveFrameBytes() { return frameBytes.load(memory_order_relaxed); }
+
+private:
+    static inline atomic<size_t> frameBytes{0};
+    coroutine_handle<promise_type> handle;
+
+    explicit SessionTask(coroutine_handle<promise_type> h) : handle(h) {}
+
+public:
+    SessionTask() = default;
+    SessionTask(SessionTask&& other) noexcept : handle(exchange(other.handle, {})) {}
+    SessionTask& operator=(SessionTask&& other) noexcept {
+        if (this != &other) {
+            if (handle) handle.destroy();
+            handle = exchange(other.handle, {});
+        }
+        return *this;
+    }
+    SessionTask(const SessionTask&) = delete;
+    SessionTask& operator=(const SessionTask&) = delete;
+    ~SessionTask() {
+        if (handle) handle.destroy();
+    }
+
+    bool done() const { return !handle || handle.done(); }
+
+    void resume() {
+        if (!done()) handle.resume();
+    }
+};
+
+// ---------------- ATM (Interface Layer) ----------------
+class ATM {
+private:
+    IBankService* homeService;       // The ATM's own bank
+    IBankService* bankService;       // This session's bank: home, or a card issuer's
+    CashDispenser* dispenser;
+    ITerminal* terminal;
+    string cashCurrency = "USD"; // Currency of the notes in the cassettes
+    User* currentUser = nullptr;     // Users are never reclaimed by the bank
+    AccountHandle currentAccount;    // Keeps the session's account resolved until logout
+    vector<AccountHandle> userAccounts; // All of currentUser's accounts, opened at login
+    string line;                     // Reused input buffer
+    ScreenBuffer screen;             // Output of the current screen
+    SessionTask task;                // The running session, if any
+    bool inputAvailable = false;     // `line` holds input for the suspended session
+    bool inputClosed = false;        // No more input will arrive
+    SessionCheckpointStore* checkpoints = nullptr; // Optional crash-resume support
+    SessionCheckpoint checkpoint;
+    string atmId = "ATM";
+
+    // Built once: the whole menu screen including its prompt
+    static constexpr string_view MENU_SCREEN =
+        "\n--- ATM Menu ---\n"
+        "1. Check Balance\n"
+        "2. Deposit\n"
+        "3. Withdraw\n"
+        "4. Show Transactions\n"
+        "5. Logout\n"
+        "6. Switch Account\n"
+        "Enter choice: ";
+
+    static ConsoleTerminal& console() {
+        static ConsoleTerminal instance;
+        return instance;
+    }
+
+    template <typename... Args>
+    void print(const Args&... args) {
+        (screen << ... << args);
+    }
+
+    void flushScreen() {
+        if (screen.empty()) return;
+        terminal->write(screen.view());
+        screen.clear();
+    }
+
+    // co_await nextInput(): ends the screen and suspends until a line is in
+    // `line`; yields false once input is closed
+    struct InputAwaiter {
+        ATM* atm;
+
+        bool await_ready() const { return atm->inputClosed; }
+        void await_suspend(coroutine_handle<>) {
+            atm->inputAvailable = false;
+            atm->flushScreen();
+        }
+        bool await_resume() const { return atm->inputAvailable && !atm->inputClosed; }
+    };
+
+    InputAwaiter nextInput() { return InputAwaiter{this}; }
+
+    void saveCheckpoint() {
+        if (checkpoints) checkpoints->save(checkpoint);
+    }
+
+    // Posts a deposit ('D'), withdrawal ('W') or cash withdrawal ('C'). With
+    // checkpointing on, the request id is on disk before the bank sees it.
+    bool post(char op, Money amount) {
+        double value = amount.toDouble();
+        const string currency = op == 'C' ? cashCurrency : "";
+        if (!checkpoints) {
+            if (op == 'D') return bankService->deposit(currentAccount, value);
+            if (op == 'W') return bankService->withdraw(currentAccount, value);
+            return bankService->withdrawInCurrency(currentAccount, value, currency);
+        }
+        checkpoint.pendingRequestId = checkpoint.sessionId + "-" + to_string(checkpoint.nextSequence++);
+        checkpoint.pendingOp = op;
+        checkpoint.pendingCents = amount.cents;
+        checkpoint.pendingReplied = checkpoint.pendingApplied = checkpoint.cashDispensed = false;
+        saveCheckpoint();
+        bool ok = op == 'D'
+            ? bankService->depositIdempotent(checkpoint.pendingRequestId, currentAccount, value)
+            : bankService->withdrawIdempotent(checkpoint.pendingRequestId, currentAccount, value, currency);
+        checkpoint.pendingReplied = true;
+        checkpoint.pendingApplied = ok;
+        saveCheckpoint();
+        return ok;
+    }
+
+    void bindSession(User* user, const string& accNum) {
+        currentUser = user;
+        userAccounts = bankService->openUserAccounts(user);
+        currentAccount = AccountHandle();
+        for (const auto& h : userAccounts) {
+            if (h.accountNumber() == accNum) currentAccount = h;
+        }
+        if (currentAccount.empty()) currentAccount = bankService->openAccountHandle(accNum);
+    }
+
+    void dispenseNotes(const DispensePlan& plan) {
+        dispenser->dispense(plan);
+        checkpoint.cashDispensed = true;
+        saveCheckpoint();
+        print("Dispensing:");
+        const auto& cassettes = dispenser->getCassettes();
+        for (size_t i = 0; i < cassettes.size(); i++) {
+            if (plan.notes[i]) print(" ", plan.notes[i], " x $", cassettes[i].denomination);
+        }
+        print("\n");
+    }
+
+    // Tells the customer what happened to the posting in flight at the restart
+    void resolvePendingRequest() {
+        const char* what = checkpoint.pendingOp == 'D' ? "deposit" : "withdrawal";
+        Money amount{checkpoint.pendingCents};
+        RequestStatus status = bankService->getRequestStatus(checkpoint.pendingRequestId);
+        if (status == RequestStatus::UNKNOWN && checkpoint.pendingReplied) {
+            // The bank keeps no log for it, but the reply made it to disk
+            status = checkpoint.pendingApplied ? RequestStatus::APPLIED : RequestStatus::REJECTED;
+        }
+        switch (status) {
+            case RequestStatus::APPLIED:
+                print("Your last ", what, " of $", amount.toDouble(), " was completed.\n");
+                if (checkpoint.pendingOp == 'C' && !checkpoint.cashDispensed) {
+                    DispensePlan plan;
+                    if (dispenser) plan = dispenser->plan(amount.toDouble(), DispensePreference::LARGE_NOTES);
+                    if (plan.ok) dispenseNotes(plan);
+                    else print("Cash could not be dispensed. Please contact your bank.\n");
+                }
+                break;
+            case RequestStatus::REJECTED:
+                print("Your last ", what, " of $", amount.toDouble(), " was declined.\n");
+                break;
+            case RequestStatus::IN_FLIGHT:
+                print("Your last ", what, " of $", amount.toDouble(), " is still being processed.\n");
+                break;
+            case RequestStatus::UNKNOWN:
+                if (bankService->keepsRequestLog()) {
+                    print("Your last ", what, " of $", amount.toDouble(), " was not processed. Please try again.\n");
+                } else { // The bank cannot tell; a retry might post it twice
+                    print("The outcome of your last ", what, " of $", amount.toDouble(),
+                          " is unknown. Please contact your bank before trying again.\n");
+                }
+                break;
+        }
+        checkpoint.pendingRequestId.clear();
+        checkpoint.pendingOp = 0;
+        saveCheckpoint();
+    }
+
+    // Only positive amounts pass; anything else is reported here
+    bool parseAmountInput(Money& amount) {
+        if (parseMoney(line, amount) && amount.cents > 0) return true;
+        print("Invalid amount.\n");
+        return false;
+    }
+
+    SessionTask session(const CardRegistry* cards, bool askCredentials) {
+        if (askCredentials) {
+            print(cards ? "Enter card or account number: " : "Enter account number: ");
+            if (!co_await nextInput()) co_return;
+            string accNum = line;
+            print("Enter PIN: ");
+            if (!co_await nextInput()) co_return;
+            bool loggedIn = (cards && cards->route(accNum).found()) ? loginWithCard(*cards, accNum, line)
+                                                                    : login(accNum, line);
+            if (!loggedIn) {
+                flushScreen();
+                co_return;
+            }
+        }
+        if (!currentUser) {
+            print("Please login first.\n");
+            flushScreen();
+            co_return;
+        }
+
+        int choice = 0, pick = 0;
+        Money amount;
+        do {
+            print(MENU_SCREEN);
+            if (!co_await nextInput()) {
+                logout(); // Input ended mid-session
+                break;
+            }
+            if (!parseChoice(line, choice)) choice = 0;
+
+            switch (choice) {
+                case 1:
+                    print("Balance: $", bankService->getBalance(currentAccount), "\n");
+                    break;
+                case 2:
+                    print("Enter amount to deposit: ");
+                    if (!co_await nextInput() || !parseAmountInput(amount)) break;
+                    if (post('D', amount))
+                        print("Deposit successful! Balance: $", bankService->getBalance(currentAccount), "\n");
+                    else
+                        print("Deposit failed.\n");
+                    break;
+                case 3:
+                    print("Enter amount to withdraw: ");
+                    if (!co_await nextInput() || !parseAmountInput(amount)) break;
+                    if (!dispenser) {
+                        reportWithdrawal(post('W', amount));
+                        break;
+                    }
+                    print("Note preference (1 = large notes, 2 = small notes): ");
+                    if (!co_await nextInput()) break;
+                    if (!parseChoice(line, pick)) pick = 1;
+                    withdrawCash(amount, pick == 2 ? DispensePreference::SMALL_NOTES
+                                                   : DispensePreference::LARGE_NOTES);
+                    break;
+                case 4:
+                    showTransactions();
+                    break;
+                case 5:
+                    logout();
+                    break;
+                case 6:
+                    listAccounts();
+                    print("Select account: ");
+                    if (!co_await nextInput()) break;
+                    if (!parseChoice(line, pick)) pick = 0;
+                    switchAccount(pick);
+                    break;
+                default:
+                    print("Invalid choice.\n");
+            }
+        } while (choice != 5 && currentUser);
+        flushScreen();
+    }
+
+    // Blocking driver: feeds the session from the terminal until it ends
+    void drive(SessionTask t) {
+        task = move(t);
+        inputClosed = false;
+        task.resume();
+        while (!task.done()) {
+            if (terminal->readLine(line)) {
+                inputAvailable = true;
+                task.resume();
+            } else {
+                closeInput();
+            }
+        }
+    }
+
+public:
+    ATM(IBankService* service, CashDispenser* cash = nullptr, ITerminal* term = nullptr)
+        : homeService(service), bankService(service), dispenser(cash), terminal(term ? term : &console()) {}
+
+    ~ATM() { flushScreen(); }
+
+    void setCashCurrency(const string& currency) { cashCurrency = currency; }
+
+    // Checkpoint every session to `store` so a restarted front end can resume it
+    void enableCheckpoints(SessionCheckpointStore* store, const string& id) {
+        checkpoints = store;
+        atmId = id;
+    }
+
+    bool login(const string& accNum, const string& pin) {
+        User* user = bankService->authenticate(accNum, pin) ? bankService->getUserByAccount(accNum) : nullptr;
+        if (user) {
+            bindSession(user, accNum);
+            if (checkpoints) {
+                auto now = chrono::system_clock::now().time_since_epoch();
+                checkpoint = SessionCheckpoint();
+                checkpoint.sessionId = atmId + "-" + to_string(chrono::duration_cast<chrono::microseconds>(now).count());
+                checkpoint.accountNumber = currentAccount.accountNumber();
+                saveCheckpoint();
+            }
+            print("Login successful!\n");
+            return true;
+        }
+        print("Invalid account number or PIN.\n");
+        return false;
+    }
+
+    // Card login: the registry picks the backend for this session by BIN
+    bool loginWithCard(const CardRegistry& cards, const string& cardNumber, const string& pin) {
+        CardRoute route = cards.route(cardNumber);
+        if (!route.found()) {
+            print("Card not recognised.\n");
+            return false;
+        }
+        bankService = route.backend; // For this session only; logout switches back
+        if (login(route.accountNumber, pin)) return true;
+        bankService = homeService;
+        return false;
+    }
+
+    void logout() {
+        bankService = homeService;
+        currentUser = nullptr;
+        currentAccount = AccountHandle();
+        userAccounts.clear();
+        if (checkpoints) checkpoints->clear();
+        checkpoint = SessionCheckpoint();
+        print("Logged out successfully.\n");
+    }
+
+    // A whole customer session: credentials, then the menu until logout
+    // or until the terminal runs out of input
+    void run(const CardRegistry* cards = nullptr) { drive(session(cards, true)); }
+
+    // The menu loop for an already logged-in user
+    void showMenu() { drive(session(nullptr, false)); }
+
+    // Reattaches a checkpointed session after a front-end restart and
+    // reports the outcome of the posting that was in flight. The customer
+    // authenticated before the restart, so the PIN is not asked again.
+    bool resumeSession(const SessionCheckpoint& saved) {
+        User* user = saved.accountNumber.empty() ? nullptr : bankService->getUserByAccount(saved.accountNumber);
+        if (!user) {
+            if (checkpoints) checkpoints->clear();
+            return false;
+        }
+        bindSession(user, saved.accountNumber);
+        checkpoint = saved;
+        print("Welcome back. Your session was restored.\n");
+        if (!checkpoint.pendingRequestId.empty()) resolvePendingRequest();
+        return true;
+    }
+
+    // Blocking resume: reattach, then continue at the menu
+    void runResumed(const SessionCheckpoint& saved) {
+        if (resumeSession(saved)) showMenu();
+        flushScreen();
+    }
+
+    // ---- Event-driven use: one thread can interleave many ATMs ----
+
+    // Starts a session; it runs until it first needs input. Pass
+    // askCredentials = false after login() or resumeSession().
+    void startSession(const CardRegistry* cards = nullptr, bool askCredentials = true) {
+        task = session(cards, askCredentials);
+        inputClosed = false;
+        task.resume();
+    }
+
+    void feedInput(string_view text) {
+        if (task.done()) return;
+        line.assign(text.data(), text.size());
+        inputAvailable = true;
+        task.resume();
+    }
+
+    // Ends the session as if the terminal hung up
+    void closeInput() {
+        inputClosed = true;
+        inputAvailable = false;
+        task.resume(); // Every later co_await completes at once
+    }
+
+    bool sessionFinished() const { return task.done(); }
+
+    // Bytes owned by this ATM, excluding its coroutine frame
+    size_t memoryFootprint() const {
+        return sizeof(ATM) + line.capacity() + screen.capacity() +
+               userAccounts.capacity() * sizeof(AccountHandle);
+    }
+
+    void reportWithdrawal(bool ok) {
+        if (ok) print("Withdrawal successful! Balance: $", bankService->getBalance(currentAccount), "\n");
+        else print("Withdrawal declined: insufficient funds or account unavailable.\n");
+    }
+
+    // Plans the notes first so undispensable amounts never reach the bank
+    void withdrawCash(Money amount, DispensePreference preference) {
+        DispensePlan plan = dispenser->plan(amount.toDouble(), preference);
+        if (!plan.ok) {
+            print("This ATM cannot dispense that amount.\n");
+            return;
+        }
+        bool ok = post('C', amount);
+        reportWithdrawal(ok);
+        if (ok) dispenseNotes(plan);
+    }
+
+    void showTransactions() {
+        vector<Transaction> history = bankService->getTransactions(currentAccount);
+        if (history.empty()) {
+            print("No transactions yet.\n");
+            return;
+        }
+        print("Transaction history for account ", currentAccount.accountNumber(), ":\n");
+        for (const auto& t : history) {
+            print(t.getTimestamp(), " | ", t.getType() == TransactionType::DEPOSIT ? "Deposit" : "Withdraw",
+                  " | Amount: $", t.getAmount(), "\n");
+        }
+    }
+
+    void listAccounts() {
+        print("Your accounts:\n");
+        for (size_t i = 0; i < userAccounts.size(); i++) {
+            print(i + 1, ". ", userAccounts[i].accountNumber(),
+                  userAccounts[i].accountNumber() == currentAccount.accountNumber() ? " (current)" : "", "\n");
+        }
+    }
+
+    // Switches among the accounts opened at login; no re-authentication
+    void switchAccount(int pick) {
+        if (pick < 1 || (size_t)pick > userAccounts.size()) {
+            print("Invalid choice.\n");
+            return;
+        }
+        currentAccount = userAccounts[pick - 1];
+        checkpoint.accountNumber = currentAccount.accountNumber();
+        saveCheckpoint();
+        print("Now using account ", currentAccount.accountNumber(), ".\n");
+    }
+};
+
+// ---------------- Headless Driver ----------------
+/*
+Replays scripted sessions through the real ATM logic. Each replay gets
+its own ScriptedTerminal and ATM, so drivers on different threads can
+replay in parallel against a shared (thread-safe) bank; a CashDispenser
+is per machine and must not be shared between threads.
+*/
+class HeadlessDriver {
+private:
+    IBankService* bank;
+    CashDispenser* cash;
+    const CardRegistry* cards;
+
+public:
+    HeadlessDriver(IBankService* service, CashDispenser* dispenser = nullptr,
+                   const CardRegistry* registry = nullptr)
+        : bank(service), cash(dispenser), cards(registry) {}
+
+    // Script: credentials first, then one line per prompt
+    SessionTranscript replay(const vector<string>& script) {
+        ScriptedTerminal terminal(script);
+        ATM atm(bank, cash, &terminal);
+        atm.run(cards);
+        return terminal.finish();
+    }
+};
+
+// ---------------- Session Manager ----------------
+/*
+Owns many multiplexed ATM sessions on one event-loop thread.
+- Each session has an idle timeout (reset by every input) and an
+  absolute timeout (from session start). Both live in a hashed
+  TimerWheel: scheduling is O(1), and resetting the idle timer just
+  bumps a generation so the old entry is ignored when it comes due.
+- On expiry the session is told it timed out, its input is closed (which
+  logs the customer out) and the ATM with its coroutine frame is freed.
+- Finished sessions are freed the same way.
+- Not thread-safe: one manager per event loop.
+*/
+class TimerWheel {
+public:
+    using Clock = chrono::steady_clock;
+
+    struct Timer {
+        uint64_t id;
+        uint64_t generation;
+        uint64_t deadlineTick;
+    };
+
+private:
+    Clock::duration tickLength;
+    Clock::time_point start;
+    uint64_t currentTick = 0;
+    vector<vector<Timer>> slots;
+
+    uint64_t tickOf(Clock::time_point t) const {
+        if (t <= start) return 0;
+        return (uint64_t)((t - start + tickLength - Clock::duration(1)) / tickLength); // Round up
+    }
+
+public:
+    TimerWheel(Clock::duration tick, size_t slotCount, Clock::time_point now = Clock::now())
+        : tickLength(tick), start(now), slots(slotCount) {}
+
+    void schedule(uint64_t id, uint64_t generation, Clock::time_point deadline) {
+        uint64_t tick = max(tickOf(deadline), currentTick + 1);
+        slots[tick % slots.size()].push_back({id, generation, tick});
+    }
+
+    // Fires onExpire(timer) for every timer due by `now`
+    template <typename Fn>
+    void advance(Clock::time_point now, Fn onExpire) {
+        uint64_t target = (uint64_t)((now - start) / tickLength);
+        if (now < start || target <= currentTick) return;
+        uint64_t steps = min<uint64_t>(target - currentTick, slots.size());
+        vector<Timer> due;
+        for (uint64_t t = target - steps + 1; t <= target; t++) {
+            auto& slot = slots[t % slots.size()];
+            auto later = partition(slot.begin(), slot.end(),
+                                   [&](const Timer& timer) { return timer.deadlineTick > target; });
+            due.insert(due.end(), later, slot.end());
+            slot.erase(later, slot.end());
+        }
+        currentTick = target;
+        for (const Timer& timer : due) onExpire(timer);
+    }
+};
+
+struct SessionMetrics {
+    size_t liveSessions = 0;
+    size_t memoryBytes = 0;     // ATM objects, their buffers and live coroutine frames
+    uint64_t timedOut = 0;
+    uint64_t completed = 0;
+};
+
+class SessionManager {
+private:
+    struct ManagedSession {
+        unique_ptr<ATM> atm;
+        ITerminal* terminal;
+        uint64_t idleGeneration = 1;
+    };
+
+    // Generation 0 marks the absolute-timeout timer
+    static const uint64_t ABSOLUTE_TIMER = 0;
+
+    IBankService* bank;
+    const CardRegistry* cards;
+    TimerWheel::Clock::duration idleTimeout;
+    TimerWheel::Clock::duration absoluteTimeout;
+    TimerWheel wheel;
+    unordered_map<uint64_t, ManagedSession> sessions;
+    uint64_t nextId = 1;
+    uint64_t timedOut = 0;
+    uint64_t completed = 0;
+
+    void reclaimIfFinished(uint64_t id) {
+        auto it = sessions.find(id);
+        if (it == sessions.end() || !it->second.atm->sessionFinished()) return;
+        sessions.erase(it);
+        completed++;
+    }
+
+public:
+    SessionManager(IBankService* service, const CardRegistry* registry,
+                   TimerWheel::Clock::duration idle, TimerWheel::Clock::duration absolute,
+                   TimerWheel::Clock::duration tick = chrono::milliseconds(100))
+        : bank(service), cards(registry), idleTimeout(idle), absoluteTimeout(absolute),
+          wheel(tick, 1024) {}
+
+    // Starts a session whose screens go to `terminal`; returns its id
+    uint64_t open(ITerminal* terminal, TimerWheel::Clock::time_point now = TimerWheel::Clock::now()) {
+        uint64_t id = nextId++;
+        ManagedSession& s = sessions[id];
+        s.atm = make_unique<ATM>(bank, nullptr, terminal);
+        s.terminal = terminal;
+        wheel.schedule(id, ABSOLUTE_TIMER, now + absoluteTimeout);
+        wheel.schedule(id, s.idleGeneration, now + idleTimeout);
+        s.atm->startSession(cards);
+        return id;
+    }
+
+    // Delivers one input line; returns false if the session no longer exists
+    bool onInput(uint64_t id, string_view text, TimerWheel::Clock::time_point now = TimerWheel::Clock::now()) {
+        auto it = sessions.find(id);
+        if (it == sessions.end()) return false;
+        ManagedSession& s = it->second;
+        wheel.schedule(id, ++s.idleGeneration, now + idleTimeout);
+        s.atm->feedInput(text);
+        reclaimIfFinished(id);
+        return true;
+    }
+
+    // The customer walked away or the connection dropped
+    void onDisconnect(uint64_t id) {
+        auto it = sessions.find(id);
+        if (it == sessions.end()) return;
+        it->second.atm->closeInput();
+        reclaimIfFinished(id);
+    }
+
+    // Expires due sessions; call periodically from the event loop
+    size_t tick(TimerWheel::Clock::time_point now = TimerWheel::Clock::now()) {
+        size_t expired = 0;
+        wheel.advance(now, [&](const TimerWheel::Timer& timer) {
+            auto it = sessions.find(timer.id);
+            if (it == sessions.end()) return;
+            ManagedSession& s = it->second;
+            if (timer.generation != ABSOLUTE_TIMER && timer.generation != s.idleGeneration) return;
+            s.terminal->write("\nSession timed out.\n");
+            s.atm->closeInput();
+            sessions.erase(it);
+            timedOut++;
+            expired++;
+        });
+        return expired;
+    }
+
+    SessionMetrics metrics() const {
+        SessionMetrics m;
+        m.liveSessions = sessions.size();
+        for (const auto& [id, s] : sessions) m.memoryBytes += sizeof(ManagedSession) + s.atm->memoryFootprint();
+        m.memoryBytes += SessionTask::liveFrameBytes();
+        m.timedOut = timedOut;
+        m.completed = completed;
+        return m;
+    }
+};
+
+// ---------------- Main ----------------
+int main() {
+    BankService bank;
+
+    // Create users and accounts
+    User* user1 = new User("Alice", "1234");
+    Account* acc1 = new Account("ACC1001", 1000);
+    user1->addAccount(acc1);
+    user1->addAccount(new Account("ACC1002", 250));
+
+    User* user2 = new User("Bob", "4321");
+    Account* acc2 = new Account("ACC2001", 500);
+    user2->addAccount(acc2);
+
+    bank.addUser(user1);
+    bank.addUser(user2);
+
+    // Load the cash cassettes: $100, $50 and $20 notes, at most $1000 per withdrawal
+    CashDispenser cash({{100, 20}, {50, 40}, {20, 100}}, 1000);
+
+    // Issue cards: BINs 400000-400999 belong to this bank
+    CardRegistry cards;
+    cards.addIssuerRange(400000, 400999, &bank);
+    cards.registerCard("4000001234561001", "ACC1001");
+    cards.registerCard("4000001234562001", "ACC2001");
+
+    ATM atm(&bank, &cash);
+    atm.run(&cards);
+
     return 0;
 }
@@ -0,0 +1,106 @@
+// Admission control: slot limits per class, queue-full rejection, CoDel
+// shedding under overload, and status lookups that are never turned away
+#include "check.h"
+
+// A backend whose calls take a while and that records how many overlap
+struct SlowBank : BankService {
+    chrono::milliseconds delay{2};
+    atomic<int> running{0}, peak{0}, bulkRunning{0}, bulkPeak{0};
+
+    template <typename Fn>
+    auto timed(bool bulk, Fn fn) {
+        int n = ++running;
+        peak = max(peak.load(), n);
+        if (bulk) {
+            int b = ++bulkRunning;
+            bulkPeak = max(bulkPeak.load(), b);
+        }
+        this_thread::sleep_for(delay);
+        if (bulk) bulkRunning--;
+        running--;
+        return fn();
+    }
+
+    bool deposit(const string& accNum, double amount) override {
+        return timed(false, [&] { return BankService::deposit(accNum, amount); });
+    }
+    double getBalance(const string& accNum) override {
+        return timed(false, [&] { return BankService::getBalance(accNum); });
+    }
+    vector<Transaction> getTransactions(const string& accNum) override {
+        return timed(true, [&] { return BankService::getTransactions(accNum); });
+    }
+};
+
+static void addAlice(BankService& bank) {
+    User* alice = new User("alice", "1111");
+    alice->addAccount(new Account("A1", 100));
+    bank.addUser(alice);
+}
+
+// Runs fn(thread index) on `n` threads and waits for them
+template <typename Fn>
+static void onThreads(int n, Fn fn) {
+    vector<thread> threads;
+    for (int t = 0; t < n; t++) threads.emplace_back(fn, t);
+    for (auto& t : threads) t.join();
+}
+
+static void slotLimits() {
+    for (int slots : {1, 3}) {
+        SlowBank bank;
+        addAlice(bank);
+        AdmissionControlledBankService admission(bank, slots);
+        atomic<int> bulkServed{0};
+        onThreads(6, [&](int t) {
+            for (int i = 0; i < 15; i++) {
+                if (t % 2) admission.deposit("A1", 1);
+                else if (!admission.getTransactions("A1").empty()) bulkServed++;
+            }
+        });
+        CHECK(bank.peak <= slots);
+        CHECK(bank.bulkPeak <= max(slots - 1, 1)); // BULK leaves a slot for the others
+        CHECK(bulkServed > 0);
+        CHECK(bank.getBalance("A1") == 100 + 3 * 15);
+    }
+}
+
+static void rejectsWhenTheQueueIsFull() {
+    SlowBank bank;
+    bank.delay = chrono::milliseconds(50);
+    addAlice(bank);
+    AdmissionControlledBankService admission(bank, 1);
+    CHECK(admission.depositIdempotent("d-1", admission.openAccountHandle("A1"), 5));
+    admission.configure(RequestClass::BULK, {0, 0, chrono::microseconds(0), chrono::microseconds(100000)});
+    thread holder([&] { admission.deposit("A1", 1); });
+    CHECK(waitUntil([&] { return bank.running == 1; }));
+    CHECK(admission.getTransactions("A1").empty()); // No room to queue
+    CHECK(admission.getStats(RequestClass::BULK).rejected == 1);
+    CHECK(admission.getRequestStatus("d-1") == RequestStatus::APPLIED); // Bypasses the slot
+    holder.join();
+}
+
+static void shedsUnderOverload() {
+    SlowBank bank;
+    addAlice(bank);
+    AdmissionControlledBankService admission(bank, 1);
+    admission.configure(RequestClass::INTERACTIVE, {1024, 0, chrono::microseconds(1000), chrono::microseconds(5000)});
+    atomic<int> failed{0};
+    onThreads(8, [&](int) {
+        for (int i = 0; i < 40; i++) {
+            if (admission.getBalance("A1") < 0) failed++;
+        }
+    });
+    RequestClassStats stats = admission.getStats(RequestClass::INTERACTIVE);
+    CHECK(stats.shed > 0);
+    CHECK(stats.shed == (uint64_t)failed.load()); // Shed calls fail like the backend would
+    CHECK(stats.admitted + stats.shed == 8 * 40);
+    CHECK(stats.queued == 0);
+}
+
+int main() {
+    slotLimits();
+    rejectsWhenTheQueueIsFull();
+    shedsUnderOverload();
+    return failures();
+}
@@ -0,0 +1,36 @@
+// Builds code.cpp into a test without its interactive main. CHECK logs a
+// failed condition and carries on; a test returns failures() from main.
+#pragma once
+
+#define main atm_main
+#include "code.cpp"
+#undef main
+
+inline int& failureCount() {
+    static int count = 0;
+    return count;
+}
+
+#define CHECK(cond)                                                                  \
+    do {                                                                             \
+        if (!(cond)) {                                                               \
+            fprintf(stderr, "%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #cond); \
+            failureCount()++;                                                        \
+        }                                                                            \
+    } while (0)
+
+inline int failures() { return failureCount() ? 1 : 0; }
+
+// A name no other test run uses, e.g. for sockets and shared memory
+inline string uniqueName(const string& prefix) { return prefix + "-" + to_string(getpid()); }
+
+// Polls `done` for up to `timeout`; returns its last value
+template <typename Fn>
+bool waitUntil(Fn done, chrono::milliseconds timeout = chrono::milliseconds(2000)) {
+    auto deadline = chrono::steady_clock::now() + timeout;
+    while (!done()) {
+        if (chrono::steady_clock::now() > deadline) return false;
+        this_thread::sleep_for(chrono::milliseconds(1));
+    }
+    return true;
+}
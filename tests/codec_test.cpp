@@ -0,0 +1,84 @@
+// ATM wire messages: round trips, and malformed input is refused
+#include "check.h"
+
+static void roundTrip() {
+    AtmMessage msg;
+    msg.mti = AtmMti::WITHDRAW_REQUEST;
+    msg.account = "ACC-1001";
+    msg.set(FIELD_ACCOUNT);
+    msg.amountMinor = 12345;
+    msg.set(FIELD_AMOUNT);
+    msg.stan = 77;
+    msg.set(FIELD_STAN);
+    msg.requestId = "req-1";
+    msg.set(FIELD_REQUEST_ID);
+    msg.currency = "EUR";
+    msg.set(FIELD_CURRENCY);
+    msg.pin = "1234";
+    msg.set(FIELD_PIN);
+
+    uint8_t buf[256];
+    size_t len = encodeMessage(msg, buf, sizeof buf);
+    CHECK(len > 0);
+    AtmMessage out;
+    CHECK(decodeMessage(buf, len, out));
+    CHECK(out.mti == AtmMti::WITHDRAW_REQUEST);
+    CHECK(out.bitmap == msg.bitmap);
+    CHECK(out.account == "ACC-1001");
+    CHECK(out.amountMinor == 12345);
+    CHECK(out.stan == 77);
+    CHECK(out.requestId == "req-1");
+    CHECK(out.currency == "EUR");
+    CHECK(out.pin == "1234");
+    CHECK(!out.has(FIELD_HISTORY));
+
+    for (size_t cut = 0; cut < len; cut++) CHECK(!decodeMessage(buf, cut, out)); // Truncated anywhere
+    CHECK(encodeMessage(msg, buf, len - 1) == 0);                                // Buffer too small
+}
+
+static void history() {
+    uint8_t entries[2 * AtmMessage::HISTORY_ENTRY_SIZE];
+    encodeHistoryEntry(entries, TransactionType::DEPOSIT, 500);
+    encodeHistoryEntry(entries + AtmMessage::HISTORY_ENTRY_SIZE, TransactionType::WITHDRAW, 200);
+    AtmMessage msg;
+    msg.mti = AtmMti::HISTORY_RESPONSE;
+    msg.history = string_view((const char*)entries, sizeof entries);
+    msg.set(FIELD_HISTORY);
+
+    uint8_t buf[64];
+    size_t len = encodeMessage(msg, buf, sizeof buf);
+    AtmMessage out;
+    CHECK(len > 0 && decodeMessage(buf, len, out));
+    vector<pair<TransactionType, int64_t>> seen;
+    forEachHistoryEntry(out.history, [&](TransactionType type, int64_t amount) { seen.push_back({type, amount}); });
+    CHECK(seen.size() == 2);
+    CHECK(seen.size() == 2 && seen[0].first == TransactionType::DEPOSIT && seen[0].second == 500);
+    CHECK(seen.size() == 2 && seen[1].first == TransactionType::WITHDRAW && seen[1].second == 200);
+}
+
+static void invalidFields() {
+    uint8_t buf[128];
+    AtmMessage msg;
+    msg.account = string_view("0123456789012345678901234567890123"); // Longer than MAX_ACCOUNT
+    msg.set(FIELD_ACCOUNT);
+    CHECK(encodeMessage(msg, buf, sizeof buf) == 0);
+
+    AtmMessage currency;
+    currency.currency = "EURO";
+    currency.set(FIELD_CURRENCY);
+    CHECK(encodeMessage(currency, buf, sizeof buf) == 0);
+
+    AtmMessage unknown;
+    unknown.set(FIELD_AMOUNT);
+    size_t len = encodeMessage(unknown, buf, sizeof buf);
+    buf[2] |= 0x01; // Field 8: not one we know
+    AtmMessage out;
+    CHECK(len > 0 && !decodeMessage(buf, len, out));
+}
+
+int main() {
+    roundTrip();
+    history();
+    invalidFields();
+    return failures();
+}
@@ -0,0 +1,59 @@
+// Event-sourced projections agree with the bank, with a fold of the log,
+// and with themselves after a parallel rebuild
+#include "check.h"
+
+int main() {
+    BankService bank;
+    EventLog log;
+    bank.setPostingObserver(&log);
+    User* alice = new User("alice", "1111");
+    for (int i = 0; i < 8; i++) alice->addAccount(new Account("A" + to_string(i), 100));
+    bank.addUser(alice);
+    for (int i = 0; i < 8; i++) log.recordOpening("A" + to_string(i), 100);
+
+    ProjectionEngine engine(log);
+    BalanceProjection* balances = engine.add<BalanceProjection>(2);
+    for (int round = 0; round < 50; round++) {
+        for (int i = 0; i < 8; i++) {
+            string accNum = "A" + to_string(i);
+            bank.deposit(accNum, i + round);
+            bank.withdraw(accNum, 1);
+        }
+    }
+    CHECK(!bank.withdraw("A0", 1e9)); // Refused: leaves no event
+    MiniStatementProjection* statements = engine.add<MiniStatementProjection>(3);
+    DailyAggregateProjection* daily = engine.add<DailyAggregateProjection>(4);
+
+    auto agrees = [&] {
+        return engine.read([&] {
+            bool ok = true;
+            for (int i = 0; i < 8; i++) {
+                string accNum = "A" + to_string(i);
+                uint32_t id = 0;
+                double projected = -1;
+                ok = ok && log.findAccount(accNum, id) && balances->balance(id, projected) &&
+                     projected == bank.getBalance(accNum) && projected == log.foldBalance(accNum);
+                vector<AccountEvent> lines = statements->statement(id);
+                ok = ok && lines.size() == MiniStatementProjection::LINES;
+                DailyTotals today = daily->totals(id, lines.back().unixTime);
+                ok = ok && today.withdrawals == 50 && today.withdrawn == 50;
+            }
+            return ok;
+        });
+    };
+    CHECK(log.size() == 8 + 8 * 50 * 2);
+    CHECK(agrees());
+    bank.deposit("A3", 7); // Picked up incrementally on the next read
+    CHECK(agrees());
+    CHECK(engine.read([&] {
+        uint32_t id = 0;
+        vector<AccountEvent> lines = log.findAccount("A3", id) ? statements->statement(id) : vector<AccountEvent>();
+        return !lines.empty() && lines.back().kind == AccountEventKind::DEPOSITED && lines.back().amount == 7;
+    }));
+    CHECK(engine.rebuild(3) == log.size());
+    CHECK(agrees());
+    CHECK(log.foldBalance("missing") == -1);
+
+    bank.setPostingObserver(nullptr);
+    return failures();
+}
@@ -0,0 +1,59 @@
+// Failover: a follower is promoted through the fencing token, the deposed
+// primary refuses postings, and clients find the new primary
+#include "check.h"
+
+static void addAlice(BankService& bank) {
+    User* alice = new User("alice", "1111");
+    alice->addAccount(new Account("A1", 100));
+    bank.addUser(alice);
+}
+
+int main() {
+    string base = "/tmp/" + uniqueName("atm-failover");
+    string fencePath = base + ".fence", journal = base + "-journal.sock";
+    string oldPrimary = base + "-p1.sock", newPrimary = base + "-p2.sock";
+    FencingToken::remove(fencePath);
+    FencingToken fence(fencePath);
+    CHECK(fence.isOpen());
+    uint64_t term1 = 0;
+    CHECK(fence.claim(0, oldPrimary, term1) && term1 == 1);
+
+    BankService primary, replica, otherReplica;
+    addAlice(primary);
+    addAlice(replica);
+    addAlice(otherReplica);
+    JournalShipper shipper(journal, term1);
+    primary.setPostingObserver(&shipper);
+    BankServer primaryServer(&primary, oldPrimary, &fence, term1);
+    FollowerBankService follower(&replica), otherFollower(&otherReplica);
+    CHECK(follower.connectTo(journal));
+    CHECK(otherFollower.connectTo(journal));
+
+    RemoteBankService client([&] { return fence.primary(); });
+    CHECK(client.deposit("A1", 10));
+    CHECK(client.withdrawIdempotent("w-1", client.openAccountHandle("A1"), 30, ""));
+    CHECK(waitUntil([&] { return follower.appliedSeq() == shipper.lastSeq(); }));
+
+    // Promotion claims term 2; a second follower of term 1 cannot claim it too
+    uint64_t term2 = 0;
+    CHECK(follower.promote(fence, newPrimary, term2) && term2 == 2);
+    uint64_t ignored = 0;
+    CHECK(!otherFollower.promote(fence, base + "-p3.sock", ignored));
+    CHECK(fence.primary() == newPrimary);
+
+    // The deposed primary refuses postings even from a client that still calls it
+    RemoteBankService stale([&] { return oldPrimary; }, chrono::milliseconds(50));
+    CHECK(!stale.deposit("A1", 1));
+    CHECK(primary.getBalance("A1") == 80);
+
+    BankServer promotedServer(&follower, newPrimary, &fence, term2);
+    CHECK(client.deposit("A1", 5)); // Reconnects to the new primary
+    CHECK(replica.getBalance("A1") == 85);
+    CHECK(client.getRequestStatus("w-1") == RequestStatus::APPLIED); // Request log carried over
+    CHECK(client.withdrawIdempotent("w-1", client.openAccountHandle("A1"), 30, "")); // A retry reports the outcome...
+    CHECK(replica.getBalance("A1") == 85);                                            // ...without posting again
+
+    primary.setPostingObserver(nullptr);
+    FencingToken::remove(fencePath);
+    return failures();
+}
@@ -0,0 +1,69 @@
+// Online shard migration: invalid requests change nothing, and a live
+// migration moves the accounts without losing a posting
+#include "check.h"
+
+int main() {
+    BankService a, b;
+    vector<User*> users;
+    for (int i = 0; i < 2000; i++) {
+        User* user = new User("user" + to_string(i), "0000");
+        user->addAccount(new Account("A" + to_string(i), 100));
+        users.push_back(user);
+    }
+    a.addUsers(users);
+    PartitionedBankService router;
+    router.addPartition("a", &a, 16);
+    router.addPartition("b", &b, 16);
+    vector<string> onA; // Only accounts routed to "a" exist
+    for (int i = 0; i < 2000; i++) {
+        if (router.partitionOf("A" + to_string(i)) == "a") onA.push_back("A" + to_string(i));
+    }
+    vector<uint64_t> points = router.pointsOf("a");
+    points.resize(8);
+    EventLog sourceObserver;
+    a.setPostingObserver(&sourceObserver);
+
+    // Refused before anything is copied
+    for (auto [pts, target] : {pair{points, string("nope")}, pair{router.pointsOf("b"), string("b")},
+                               pair{vector<uint64_t>(), string("b")}}) {
+        MigrationStats s = ShardMigration(a, b, router, pts, target).run();
+        CHECK(!s.completed && s.accounts == 0);
+    }
+    CHECK(router.pointsOf("a").size() == 16);
+    for (int i = 0; i < 2000; i++) CHECK(!b.getUserByAccount("A" + to_string(i)));
+
+    // Postings keep arriving through the router during the migration
+    atomic<bool> stop{false};
+    atomic<long> approved{0};
+    vector<thread> posters;
+    for (int t = 0; t < 3; t++) {
+        posters.emplace_back([&, t] {
+            for (size_t i = t; !stop; i += 7) {
+                if (router.deposit(onA[i % onA.size()], 1)) approved++;
+            }
+        });
+    }
+    this_thread::sleep_for(chrono::milliseconds(10));
+    MigrationStats s = ShardMigration(a, b, router, points, "b").run();
+    this_thread::sleep_for(chrono::milliseconds(10));
+    stop = true;
+    for (auto& t : posters) t.join();
+
+    CHECK(s.completed && s.accounts > 0);
+    CHECK(a.getPostingObserver() == &sourceObserver); // Handed back afterwards
+    unordered_set<uint64_t> movedPoints(points.begin(), points.end());
+    size_t moved = 0;
+    double total = 0;
+    for (const string& accNum : onA) {
+        total += router.getBalance(accNum);
+        if (!movedPoints.count(router.pointOf(accNum))) continue;
+        moved++;
+        CHECK(router.partitionOf(accNum) == "b");
+        CHECK(a.getBalance(accNum) == -1);
+        CHECK(b.getBalance(accNum) >= 100);
+    }
+    CHECK(moved == s.accounts);
+    CHECK(total == onA.size() * 100.0 + approved.load()); // Nothing lost or applied twice
+    a.setPostingObserver(nullptr);
+    return failures();
+}
@@ -0,0 +1,74 @@
+// Consistent-hash partitioning: shares even out, membership changes move
+// only the accounts they must, and paused points hold postings back
+#include "check.h"
+
+static const int ACCOUNTS = 3000;
+
+static string accountNumber(int i) { return "ACC" + to_string(100000 + i); }
+
+int main() {
+    BankService a, b, c;
+    PartitionedBankService router;
+    CHECK(router.addPartition("a", &a));
+    CHECK(router.addPartition("b", &b));
+    CHECK(router.addPartition("c", &c));
+    CHECK(!router.addPartition("c", &c)); // Name taken
+
+    unordered_map<string, BankService*> byName{{"a", &a}, {"b", &b}, {"c", &c}};
+    unordered_map<string, int> share;
+    vector<string> before(ACCOUNTS);
+    for (int i = 0; i < ACCOUNTS; i++) {
+        before[i] = router.partitionOf(accountNumber(i));
+        share[before[i]]++;
+        User* user = new User("user" + to_string(i), "0000");
+        user->addAccount(new Account(accountNumber(i), 0));
+        byName[before[i]]->addUser(user);
+    }
+    for (const auto& [name, n] : share) CHECK(n > ACCOUNTS / 5 && n < ACCOUNTS / 2);
+
+    // Postings through the router land on the owning partition
+    for (int i = 0; i < ACCOUNTS; i += 7) CHECK(router.deposit(accountNumber(i), 10));
+    for (int i = 0; i < ACCOUNTS; i += 7) {
+        CHECK(byName[before[i]]->getBalance(accountNumber(i)) == 10);
+        CHECK(router.getBalance(accountNumber(i)) == 10);
+    }
+
+    // Removing a partition moves only its own accounts
+    CHECK(router.removePartition("c"));
+    for (int i = 0; i < ACCOUNTS; i++) {
+        string now = router.partitionOf(accountNumber(i));
+        CHECK(now != "c");
+        if (before[i] != "c") CHECK(now == before[i]);
+    }
+    // A new partition takes accounts only from the others
+    BankService d;
+    CHECK(router.addPartition("d", &d));
+    int moved = 0;
+    for (int i = 0; i < ACCOUNTS; i++) {
+        string now = router.partitionOf(accountNumber(i));
+        if (before[i] != "c" && now != before[i]) {
+            CHECK(now == "d");
+            moved++;
+        }
+    }
+    CHECK(moved > 0 && moved < ACCOUNTS / 2);
+
+    // A posting to a paused point waits for the point to be released
+    int stayed = 0;
+    while (router.partitionOf(accountNumber(stayed)) != before[stayed]) stayed++; // Its account is on a or b
+    string held = accountNumber(stayed);
+    vector<uint64_t> point{router.pointOf(held)};
+    CHECK(router.pauseWrites(point));
+    atomic<bool> done{false};
+    double startBalance = router.getBalance(held);
+    thread poster([&] {
+        router.deposit(held, 1);
+        done = true;
+    });
+    this_thread::sleep_for(chrono::milliseconds(20));
+    CHECK(!done);
+    router.resumeWrites(point);
+    poster.join();
+    CHECK(router.getBalance(held) == startBalance + 1);
+    return failures();
+}
@@ -0,0 +1,96 @@
+// Journal shipping: a follower mirrors postings, refused requests and
+// account openings and closures, and stops once it has drifted
+#include "check.h"
+
+static void addAlice(BankService& bank) {
+    User* alice = new User("alice", "1111");
+    alice->addAccount(new Account("A1", 100));
+    bank.addUser(alice);
+}
+
+static bool caughtUp(FollowerBankService& follower, JournalShipper& shipper) {
+    return waitUntil([&] { return follower.appliedSeq() == shipper.lastSeq() || follower.hasDiverged(); });
+}
+
+static void mirrorsThePrimary() {
+    string socket = "/tmp/" + uniqueName("atm-replication") + ".sock";
+    BankService primary, replica;
+    addAlice(primary);
+    addAlice(replica);
+    JournalShipper shipper(socket, 1);
+    CHECK(shipper.isListening());
+    primary.setPostingObserver(&shipper);
+    FollowerBankService follower(&replica);
+    CHECK(follower.connectTo(socket));
+
+    primary.deposit("A1", 50);
+    AccountHandle a1 = primary.openAccountHandle("A1");
+    CHECK(primary.withdrawIdempotent("w-1", a1, 30, ""));
+    CHECK(!primary.withdrawIdempotent("w-2", a1, 1000, "")); // Refused: insufficient funds
+
+    User* bob = new User("bob", "2222");
+    bob->addAccount(new Account("B1", 40, "EUR"));
+    bob->addAccount(new Account("B2", 0, "EUR"));
+    primary.addUser(bob);
+    primary.deposit("B1", 5);
+    CHECK(primary.closeAccount("B2"));
+    CHECK(caughtUp(follower, shipper));
+
+    CHECK(replica.getBalance("A1") == 120);
+    CHECK(replica.getRequestStatus("w-1") == RequestStatus::APPLIED);
+    CHECK(replica.getRequestStatus("w-2") == RequestStatus::REJECTED);
+    CHECK(replica.getBalance("B1") == 45);
+    CHECK(replica.getCurrency("B1") == "EUR");
+    CHECK(replica.getBalance("B2") == -1); // Closed on the follower too
+    User* replicatedBob = replica.getUserByAccount("B1");
+    CHECK(replicatedBob && replicatedBob->authenticate("2222"));
+    CHECK(follower.getStats().failed == 0);
+
+    CHECK(!follower.deposit("A1", 1)); // Read-only until promoted
+    a1 = AccountHandle();
+    primary.setPostingObserver(nullptr);
+}
+
+static void stopsWhenDiverged() {
+    string socket = "/tmp/" + uniqueName("atm-divergence") + ".sock";
+    BankService primary, replica;
+    addAlice(primary);
+    addAlice(replica);
+    JournalShipper shipper(socket, 1);
+    primary.setPostingObserver(&shipper);
+    FollowerBankService follower(&replica);
+    CHECK(follower.connectTo(socket));
+
+    primary.deposit("A1", 1);
+    CHECK(caughtUp(follower, shipper));
+    uint64_t good = follower.appliedSeq();
+    replica.releaseAccounts({"A1"}); // The replica no longer matches the primary
+    primary.deposit("A1", 1);
+    primary.deposit("A1", 1);
+    CHECK(waitUntil([&] { return follower.hasDiverged(); }));
+    CHECK(follower.appliedSeq() == good); // Stopped at the first entry it could not apply
+    CHECK(follower.getStats().failed == 1);
+    CHECK(waitUntil([&] { return !follower.isConnected(); }));
+    CHECK(!follower.connectTo(socket));
+    primary.setPostingObserver(nullptr);
+}
+
+static void refusesAFollowerTheJournalNoLongerHolds() {
+    string socket = "/tmp/" + uniqueName("atm-late") + ".sock";
+    BankService primary, replica;
+    addAlice(primary);
+    addAlice(replica);
+    JournalShipper shipper(socket, 1, 0, 0, 1 << 16); // One chunk of journal
+    primary.setPostingObserver(&shipper);
+    while (shipper.oldestHeldSeq() == 0) primary.deposit("A1", 1);
+    FollowerBankService follower(&replica);
+    CHECK(!follower.connectTo(socket)); // Must be rebuilt from the primary instead
+    primary.setPostingObserver(nullptr);
+}
+
+int main() {
+    mirrorsThePrimary();
+    stopsWhenDiverged();
+    refusesAFollowerTheJournalNoLongerHolds();
+    return failures();
+}
@@ -0,0 +1,68 @@
+// Cross-partition transfers: commit, abort without side effects, and
+// recovery of transfers a coordinator left in doubt
+#include "check.h"
+
+static void addAccounts(BankService& bank, const vector<tuple<string, double, string>>& accounts) {
+    User* user = new User("owner", "0000");
+    for (const auto& [accNum, balance, currency] : accounts) user->addAccount(new Account(accNum, balance, currency));
+    bank.addUser(user);
+}
+
+static void writeFile(const string& path, const string& text) {
+    FILE* f = fopen(path.c_str(), "w");
+    fputs(text.c_str(), f);
+    fclose(f);
+}
+
+int main() {
+    BankService x, y;
+    addAccounts(x, {{"X1", 100, "USD"}});
+    addAccounts(y, {{"Y1", 0, "USD"}, {"Y2", 0, "JPY"}});
+    RoutingBankService router;
+    router.setRoutes({{"X", &x}, {"Y", &y}});
+    string logPath = "/tmp/" + uniqueName("atm-2pc") + ".log";
+    unlink(logPath.c_str());
+
+    {
+        TransferCoordinator coordinator(router, logPath, "c");
+        CHECK(coordinator.isOpen());
+        CHECK(coordinator.transfer("X1", "Y1", 30) == TransferOutcome::COMMITTED);
+        CHECK(x.getBalance("X1") == 70 && y.getBalance("Y1") == 30);
+
+        // Insufficient funds: the hold is refused and nothing else is posted
+        size_t postings = x.getTransactions("X1").size();
+        CHECK(coordinator.transfer("X1", "Y1", 1000) == TransferOutcome::ABORTED);
+        // Refused before logging: bad amount, unknown account, other currency
+        vector<TransferOutcome> refused =
+            coordinator.transferBatch({{"X1", "Y1", -5}, {"X1", "NOPE", 5}, {"X1", "Y2", 5}, {"X1", "Y1", 10}});
+        CHECK(refused[0] == TransferOutcome::ABORTED && refused[1] == TransferOutcome::ABORTED &&
+              refused[2] == TransferOutcome::ABORTED && refused[3] == TransferOutcome::COMMITTED);
+        CHECK(x.getTransactions("X1").size() == postings + 1); // Only the committed transfer's hold
+        CHECK(x.getBalance("X1") == 60 && y.getBalance("Y1") == 40 && y.getBalance("Y2") == 0);
+        TransferStats stats = coordinator.getStats();
+        CHECK(stats.committed == 2 && stats.aborted == 4 && stats.inDoubt == 0);
+    }
+
+    // A coordinator that crashed mid-protocol: transfer 101 held but undecided,
+    // 102 held and committed, 103 logged but its hold never sent
+    CHECK(router.withdrawIdempotent("c:101:H", AccountHandle::unresolved("X1"), 10, ""));
+    CHECK(router.withdrawIdempotent("c:102:H", AccountHandle::unresolved("X1"), 20, ""));
+    writeFile(logPath, "N 101\nB 101 X1 Y1 1000\nB 102 X1 Y1 2000\nC 102\nB 103 X1 Y1 500\nB 104 X1 Y1 7");
+    {
+        TransferCoordinator coordinator(router, logPath, "c");
+        CHECK(coordinator.getStats().inDoubt == 3); // The torn record for 104 is skipped
+        CHECK(coordinator.recover() == 0);
+        TransferStats stats = coordinator.getStats();
+        CHECK(stats.recovered == 3 && stats.committed == 1 && stats.aborted == 2);
+        CHECK(x.getBalance("X1") == 40); // 101 refunded, 102 paid, 103 held and refunded
+        CHECK(y.getBalance("Y1") == 60);
+        CHECK(coordinator.transfer("X1", "Y1", 1) == TransferOutcome::COMMITTED); // Ids continue past the log
+    }
+    {
+        TransferCoordinator reopened(router, logPath, "c");
+        CHECK(reopened.getStats().inDoubt == 0); // Settled transfers stay settled
+    }
+    CHECK(x.getBalance("X1") == 39 && y.getBalance("Y1") == 61);
+    unlink(logPath.c_str());
+    return failures();
+}